@@ -3,26 +3,41 @@
  * Sensirion SPS30 particulate matter sensor driver
  *
  * Copyright (c) Tomasz Duszynski <tduszyns@gmail.com>
- *
- * I2C slave address: 0x69
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <asm/unaligned.h>
+#include <linux/completion.h>
 #include <linux/crc8.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
-#include <linux/i2c.h>
+#include <linux/hrtimer.h>
 #include <linux/iio/buffer.h>
+#include <linux/iio/events.h>
 #include <linux/iio/iio.h>
 #include <linux/iio/sysfs.h>
 #ifdef CONFIG_IIO_BUFFER
+#include <linux/iio/trigger.h>
 #include <linux/iio/trigger_consumer.h>
 #include <linux/iio/triggered_buffer.h>
 #endif /* CONFIG_IIO_BUFFER */
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/pm_runtime.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "sps30.h"
 
+#define CREATE_TRACE_POINTS
+#include "sps30_trace.h"
 
 /* Sensirion compatibility code for older Kernel versions */
 #include <linux/version.h>
@@ -44,21 +59,19 @@
 	.channel2 = IIO_MOD_ ## _mod, \
 	.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED), \
 	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE), \
+	.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO) | \
+				   BIT(IIO_CHAN_INFO_SAMP_FREQ), \
 	.address = _mod, \
+	.event_spec = sps30_events, \
+	.num_event_specs = ARRAY_SIZE(sps30_events), \
 	.scan_index = _index, \
 	.scan_type = { \
 		.sign = 'u', \
-		.realbits = 19, \
+		.realbits = 25, \
 		.storagebits = 32, \
 		.endianness = IIO_CPU, \
 	}, \
 }
-static int sps30_probe(struct i2c_client *client);
-static int sps30_probe_old(struct i2c_client *client,
-			   const struct i2c_device_id *id)
-{
-    return sps30_probe(client);
-}
 #endif /* LINUX_VERSION_CODE < 4.21.0 */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
 /* Disable triggered buffer support on Linux < 4.9.0 due to unsufficient support */
@@ -107,417 +120,2326 @@ static inline int devm_add_action_or_reset(struct device *dev,
 	struct iio_dev_attr iio_dev_attr_##_name                \
 	= IIO_ATTR_RW(_name, _addr)
 #endif /* IIO_DEVICE_ATTR_RW */
-
-
-#define SPS30_CRC8_POLYNOMIAL 0x31
-/* max number of bytes needed to store PM measurements or serial string */
-#define SPS30_MAX_READ_SIZE 48
-/* sensor measures reliably up to 3000 ug / m3 */
-#define SPS30_MAX_PM 3000
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#include <kunit/visibility.h>
+#elif IS_ENABLED(CONFIG_KUNIT)
+/* helpers tested by sps30_kunit are exported for it */
+#define VISIBLE_IF_KUNIT
+#define EXPORT_SYMBOL_IF_KUNIT(symbol) EXPORT_SYMBOL_GPL(symbol)
+#else /* !CONFIG_KUNIT */
+#define VISIBLE_IF_KUNIT static
+#define EXPORT_SYMBOL_IF_KUNIT(symbol)
+#endif /* LINUX_VERSION_CODE >= 6.2.0 */
+/* decimal places of concentrations, 3000 ug / m3 take 25 bits at most */
+#define SPS30_DECIMALS_MIN 2
+#define SPS30_DECIMALS_MAX 4
+/* measurement output formats */
+#define SPS30_FORMAT_FLOAT 0x03
+#define SPS30_FORMAT_UINT16 0x05
+/* first firmware supporting integer output format */
+#define SPS30_UINT16_MIN_FW_MAJOR 2
 /* minimum and maximum self cleaning periods in seconds */
 #define SPS30_AUTO_CLEANING_PERIOD_MIN 0
 #define SPS30_AUTO_CLEANING_PERIOD_MAX 604800
+#define SPS30_AUTO_CLEANING_PERIOD_DEFAULT 604800
+/* fan cleaning takes 10 seconds, no measurements are taken meanwhile */
+#define SPS30_CLEANING_MS 10000
+/* data-ready timeouts closer together are not taken for cleaning */
+#define SPS30_CLEANING_GUARD_MS 60000
+/* how often idle cleaning looks for a lull in demand */
+#define SPS30_IDLE_CLEANING_RETRY_MS 60000
+/* sensor produces a new set of measurements every second */
+#define SPS30_MEAS_PERIOD_MS 1000
+#define SPS30_MEAS_PERIOD_NS (SPS30_MEAS_PERIOD_MS * NSEC_PER_MSEC)
+/* maximum age of a cached measurement in milliseconds */
+#define SPS30_CACHE_MAX_AGE_MAX 60000
+/* give up waiting for new measurements after that many milliseconds */
+#define SPS30_DATA_READY_TIMEOUT_MS 1500
+/* poll that long after the predicted arrival of a frame */
+#define SPS30_SCHED_MARGIN_US 1000
+/* pull prediction earlier by that much on every hit to follow the drift */
+#define SPS30_SCHED_CREEP_US 250
+/* interval of data-ready polls while arrival of frames is unknown */
+#define SPS30_SCHED_STEP_MS 10
+/* ceiling of the data-ready poll interval once the prediction missed */
+#define SPS30_SCHED_STEP_MAX_MS 300
+/* frames further apart than that are not used to learn the period */
+#define SPS30_SCHED_MAX_GAP 16
+/* idle time after which measurement is stopped and sensor put to sleep */
+#define SPS30_AUTOSUSPEND_DELAY_MS 5000
+#define SPS30_SLEEP_MIN_FW_MAJOR 2
+/* status register appeared in firmware 2.2 */
+#define SPS30_STATUS_MIN_FW 0x0202
+/* how often sampling work refreshes the device status */
+#define SPS30_STATUS_PERIOD_MS 60000
+/* transient bus errors are retried this many times before giving up */
+#define SPS30_MAX_RETRIES 2
+/* consecutive failed measurements which trigger sensor reset */
+#define SPS30_RECOVER_THRESHOLD 3
+#define SPS30_RECOVER_BACKOFF_MIN_MS 1000
+#define SPS30_RECOVER_BACKOFF_MAX_MS 60000
+/* up to a minute worth of frames can be averaged */
+#define SPS30_OSR_MAX 60
+/* latency histograms span 1 us to 2^23 us, about 8 s */
+#define SPS30_HIST_BUCKETS 24
 
-/* SPS30 commands */
-#define SPS30_START_MEAS 0x0010
-#define SPS30_STOP_MEAS 0x0104
-#define SPS30_RESET 0xd304
-#define SPS30_READ_DATA_READY_FLAG 0x0202
-#define SPS30_READ_DATA 0x0300
-#define SPS30_READ_SERIAL 0xd033
-#define SPS30_START_FAN_CLEANING 0x5607
-#define SPS30_AUTO_CLEANING_PERIOD 0x8004
-/* not a sensor command per se, used only to distinguish write from read */
-#define SPS30_READ_AUTO_CLEANING_PERIOD 0x8005
+enum {
+	RESET,
+	MEASURING,
+};
 
 enum {
-	PM1,
-	PM2P5,
-	PM4,
-	PM10,
+	SPS30_OSR_MEAN,
+	SPS30_OSR_EMA,
+};
+
+/* modifiers of the mass concentration channels, in measurement order */
+static const int sps30_pm_mods[] = {
+	[PM1] = IIO_MOD_PM1,
+	[PM2P5] = IIO_MOD_PM2P5,
+	[PM4] = IIO_MOD_PM4,
+	[PM10] = IIO_MOD_PM10,
+};
+
+static const char * const sps30_osr_modes[] = {
+	[SPS30_OSR_MEAN] = "mean",
+	[SPS30_OSR_EMA] = "ema",
+};
+
+struct sps30_frame {
+	/* time the frame became available */
+	ktime_t ts;
+	s32 meas[TPS + 1];
 };
 
 enum {
-	RESET,
-	MEASURING,
+	SPS30_CNT_PRED_HITS,
+	SPS30_CNT_PRED_MISSES,
+	SPS30_CNT_PUSHED,
+	SPS30_CNT_SKIPPED,
+	SPS30_CNT_TIMEDOUT,
+	SPS30_CNT_RETRIES,
+	SPS30_CNT_RECOVERIES,
+	SPS30_CNT_CLEANINGS,
+	SPS30_CNT_MAX,
+};
+
+static const struct {
+	u16 cmd;
+	const char *name;
+} sps30_cmds[] = {
+	{ SPS30_START_MEAS, "start_meas" },
+	{ SPS30_STOP_MEAS, "stop_meas" },
+	{ SPS30_RESET, "reset" },
+	{ SPS30_READ_DATA_READY_FLAG, "read_data_ready_flag" },
+	{ SPS30_READ_DATA, "read_data" },
+	{ SPS30_READ_SERIAL, "read_serial" },
+	{ SPS30_READ_VERSION, "read_version" },
+	{ SPS30_START_FAN_CLEANING, "start_fan_cleaning" },
+	{ SPS30_AUTO_CLEANING_PERIOD, "write_auto_cleaning_period" },
+	{ SPS30_READ_AUTO_CLEANING_PERIOD, "read_auto_cleaning_period" },
+	{ SPS30_SLEEP, "sleep" },
+	{ SPS30_WAKEUP, "wakeup" },
+	{ SPS30_READ_DEVICE_STATUS, "read_device_status" },
+};
+
+/*
+ * Bus related statistics exposed through debugfs. Updated by whoever holds
+ * the bus lock or the fetch of a frame, except meas_hist which is guarded by
+ * frame_lock.
+ */
+struct sps30_stats {
+	u64 cmds[ARRAY_SIZE(sps30_cmds)];
+	u64 tx_bytes;
+	u64 rx_bytes;
+	u64 crc_errors;
+	/* data-ready polls and frames read out */
+	u64 polls;
+	u64 frames;
+	u64 timeouts;
+	/* log2 histograms of latency in microseconds */
+	u64 xfer_hist[SPS30_HIST_BUCKETS];
+	u64 meas_hist[SPS30_HIST_BUCKETS];
+};
+
+/*
+ * Sensor produces frames at a fixed cadence so once arrival of one frame
+ * is known arrival of the following ones can be predicted and data-ready
+ * flag polled only when a frame is already there.
+ */
+struct sps30_sched {
+	/* estimated arrival of the most recent frame */
+	ktime_t anchor;
+	bool synced;
+	/* learned frame period */
+	s64 period_ns;
+	/* time the most recent frame was read out */
+	ktime_t consumed;
+	/* time of the most recent poll which found no new frame */
+	ktime_t polled;
+	/* fires once a frame is expected to be there */
+	struct hrtimer timer;
+	wait_queue_head_t wq;
+	bool expired;
+	/* whether the timer should also kick the sampling work */
+	bool kick;
+	/* whether the sampling work was woken up by a prediction */
+	bool predicted;
+};
+
+/*
+ * All sensors share the same address so each one sits on its own mux
+ * channel. Sensors behind the same root adapter are given evenly spaced
+ * slots within the frame period so that their frames, and hence polls and
+ * readouts, do not pile up on the bus at the same time.
+ */
+struct sps30_bus {
+	struct list_head node;
+	const void *root;
+	/* members ordered by mux channel */
+	struct list_head devices;
+	unsigned int count;
+	/* slots are laid out relative to this */
+	ktime_t epoch;
+	/* serializes each member's poll and readout against the others */
+	struct mutex lock;
 };
 
 struct sps30_state {
-	struct i2c_client *client;
+	struct device *dev;
+	struct iio_dev *indio_dev;
+	/* transport moving commands to and from the sensor */
+	const struct sps30_ops *ops;
+	void *priv;
+	/* sensor is reset and identified off the probe path */
+	struct work_struct init_work;
+	struct completion init_done;
+	int init_err;
 	/*
 	 * Guards against concurrent access to sensor registers.
 	 * Must be held whenever sequence of commands is to be executed.
+	 * Never held while waiting for new measurements.
 	 */
 	struct mutex lock;
 	int state;
+	/* sensor is in sleep mode and needs waking up before use */
+	bool asleep;
+	/*
+	 * Guards everything related to measurements below, except the
+	 * scheduler which belongs to whoever is fetching a frame.
+	 */
+	spinlock_t frame_lock;
+	u8 fw_major;
+	u8 fw_minor;
+	/* read once during initialization, status refreshed by sampling */
+	char serial[32];
+	u32 status;
+	/* sensor reports the old period until reset, remember what was set */
+	u32 cleaning_period;
+	bool cleaning_period_valid;
+	ktime_t status_ts;
+	/* measurements are reported as 16 bit integers instead of floats */
+	bool uint16_format;
+	/* concentrations are kept in units of 1 / res, res = 10 ^ decimals */
+	int decimals;
+	u32 res;
+	/*
+	 * Last measurement read from the sensor. Channels are served from
+	 * here as long as the frame is not older than cache_max_age_ms.
+	 */
+	struct sps30_frame frame;
+	/* number of valid measurements in the frame */
+	int frame_len;
+	unsigned int cache_max_age_ms;
+	/* somebody is talking to the sensor, others wait for the outcome */
+	bool fetching;
+	unsigned int fetch_seq;
+	int fetch_err;
+	/* frames read so far, sample_seq readers are notified of changes */
+	unsigned int sample_seq;
+	wait_queue_head_t frame_wq;
+	/* every complete frame read from the sensor, oldest first */
+	DECLARE_KFIFO_PTR(ring, struct sps30_frame);
+	/* pulls frames off the sensor while in continuous mode */
+	struct delayed_work sample_work;
+	bool continuous;
+	/* fires once per frame pulled off the sensor */
+	struct iio_trigger *trig;
+	bool trig_enabled;
+	/* trigger handler skips a capture instead of waiting for the sensor */
+	bool nonblocking;
+	/* time of the frame pushed to the buffer most recently */
+	ktime_t pushed_ts;
+	/*
+	 * Own trigger fires once per this many frames which are then pushed
+	 * from the ring all at once, so readers wake up once per batch.
+	 */
+	unsigned int watermark;
+	unsigned int batch_n;
+	/* serializes pushes to the buffer and guards the batch */
+	struct mutex push_lock;
+	struct sps30_frame *batch;
+	/*
+	 * Number of frames reduced into a single output value. Frames are
+	 * either averaged in blocks or fed to an exponential moving average
+	 * which is sampled once per block.
+	 */
+	unsigned int osr;
+	int osr_mode;
+	s64 acc[TPS + 1];
+	unsigned int acc_n;
+	bool ema_primed;
+	struct sps30_frame avg;
+	bool avg_valid;
+	/* most recent frame completed a block */
+	bool reduced;
+	/*
+	 * Threshold events on mass concentrations, indexed by measurement
+	 * and direction (rising first). Once fired an event is not reported
+	 * again until the value moves back past the threshold by hysteresis.
+	 */
+	s32 thresh[PM10 + 1][2];
+	s32 hyst[PM10 + 1][2];
+	unsigned long ev_enabled;
+	unsigned long ev_fired;
+	struct sps30_sched sched;
+	/* best guess of when the frame about to be read became available */
+	ktime_t ready_ts;
+	unsigned int counters[SPS30_CNT_MAX];
+	/* shared bus scheduling, NULL unless enabled */
+	struct sps30_bus *bus;
+	struct list_head bus_node;
+	int bus_pos;
+	/* offset of the frames within the period */
+	s64 slot_ns;
+	struct sps30_stats stats;
+	struct dentry *debugfs;
+	/* measurements failed in a row and when reset may be tried again */
+	unsigned int failures;
+	unsigned int backoff_ms;
+	ktime_t recover_at;
+	/* start and end of the last cleaning, frames are not updated inside */
+	ktime_t cleaned_ts;
+	ktime_t clean_until;
+	/* automatic cleaning interval counts from reset or the last one */
+	ktime_t auto_cleaned_ts;
+	/* driver cleans the fan itself whenever demand is low */
+	struct delayed_work clean_work;
+	unsigned int idle_cleaning_period;
 };
 
-DECLARE_CRC8_TABLE(sps30_crc8_table);
+static unsigned int ring_depth = 16;
+module_param(ring_depth, uint, 0444);
+MODULE_PARM_DESC(ring_depth,
+		 "Number of recent measurements kept per device, rounded up to a power of 2 (default: 16)");
+
+static bool uint16_format = true;
+module_param(uint16_format, bool, 0444);
+MODULE_PARM_DESC(uint16_format,
+		 "Use integer output format if supported by firmware (default: Y)");
+
+static unsigned int decimals = SPS30_DECIMALS_MIN;
+module_param(decimals, uint, 0444);
+MODULE_PARM_DESC(decimals,
+		 "Decimal places of concentrations, 2 to 4 (default: 2)");
+
+static bool bus_sched;
+module_param(bus_sched, bool, 0444);
+MODULE_PARM_DESC(bus_sched,
+		 "Spread measurements of sensors sharing a bus across the frame period (default: N)");
+
+static LIST_HEAD(sps30_buses);
+static DEFINE_MUTEX(sps30_buses_lock);
 
-static int sps30_write_then_read(struct sps30_state *state, u8 *txbuf,
-				 int txsize, u8 *rxbuf, int rxsize)
+static void sps30_stats_hist(u64 *hist, ktime_t start)
 {
-	int ret;
+	s64 us = ktime_us_delta(ktime_get(), start);
 
-	/*
-	 * Sensor does not support repeated start so instead of
-	 * sending two i2c messages in a row we just send one by one.
-	 */
-	ret = i2c_master_send(state->client, txbuf, txsize);
-	if (ret != txsize)
-		return ret < 0 ? ret : -EIO;
+	hist[us > 0 ? min_t(int, ilog2(us), SPS30_HIST_BUCKETS - 1) : 0]++;
+}
 
-	if (!rxbuf)
-		return 0;
+/* filled in on probe, before transports get to talk to the sensor */
+u8 sps30_crc8_table[CRC8_TABLE_SIZE];
+EXPORT_SYMBOL_GPL(sps30_crc8_table);
 
-	ret = i2c_master_recv(state->client, rxbuf, rxsize);
-	if (ret != rxsize)
-		return ret < 0 ? ret : -EIO;
+void *sps30_get_priv(struct sps30_state *state)
+{
+	return state->priv;
+}
+EXPORT_SYMBOL_GPL(sps30_get_priv);
 
-	return 0;
+void sps30_xfer_done(struct sps30_state *state, ktime_t start, int txsize,
+		     int rxsize, int ret)
+{
+	if (!ret) {
+		state->stats.tx_bytes += txsize;
+		state->stats.rx_bytes += rxsize;
+	}
+	sps30_stats_hist(state->stats.xfer_hist, start);
+	trace_sps30_xfer(state->dev, txsize, rxsize, ret);
+}
+EXPORT_SYMBOL_GPL(sps30_xfer_done);
+
+static int sps30_bad_msg(struct sps30_state *state)
+{
+	state->stats.crc_errors++;
+	dev_err(state->dev, "data integrity check failed\n");
+
+	return -EBADMSG;
+}
+
+static int __sps30_do_cmd(struct sps30_state *state, u16 cmd, u8 *data,
+			  int size)
+{
+	u8 format;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(sps30_cmds); i++) {
+		if (sps30_cmds[i].cmd == cmd) {
+			state->stats.cmds[i]++;
+			break;
+		}
+	}
+
+	/* output format is the only argument, callers need not care */
+	if (cmd == SPS30_START_MEAS) {
+		format = state->uint16_format ? SPS30_FORMAT_UINT16 :
+						SPS30_FORMAT_FLOAT;
+		data = &format;
+		size = sizeof(format);
+	}
+
+	trace_sps30_cmd_start(state->dev, cmd, size, 0);
+	ret = state->ops->do_cmd(state, cmd, data, size);
+	trace_sps30_cmd_end(state->dev, cmd, size, ret);
+	if (ret == -EBADMSG)
+		sps30_bad_msg(state);
+
+	return ret;
+}
+
+/* garbled or not acknowledged transfers are worth another try */
+static bool sps30_is_transient(int ret)
+{
+	return ret == -EIO || ret == -EREMOTEIO || ret == -ENXIO ||
+	       ret == -EAGAIN || ret == -EBADMSG;
 }
 
 static int sps30_do_cmd(struct sps30_state *state, u16 cmd, u8 *data, int size)
 {
-	/*
-	 * Internally sensor stores measurements in a following manner:
-	 *
-	 * PM1: upper two bytes, crc8, lower two bytes, crc8
-	 * PM2P5: upper two bytes, crc8, lower two bytes, crc8
-	 * PM4: upper two bytes, crc8, lower two bytes, crc8
-	 * PM10: upper two bytes, crc8, lower two bytes, crc8
-	 *
-	 * What follows next are number concentration measurements and
-	 * typical particle size measurement which we omit.
-	 */
-	u8 buf[SPS30_MAX_READ_SIZE] = { cmd >> 8, cmd };
-	int i, ret = 0;
+	bool retry;
+	int i, ret;
 
+	/* only reads are side effect free, commands are left alone */
 	switch (cmd) {
-	case SPS30_START_MEAS:
-		buf[2] = 0x03;
-		buf[3] = 0x00;
-		buf[4] = crc8(sps30_crc8_table, &buf[2], 2, CRC8_INIT_VALUE);
-		ret = sps30_write_then_read(state, buf, 5, NULL, 0);
-		break;
-	case SPS30_STOP_MEAS:
-	case SPS30_RESET:
-	case SPS30_START_FAN_CLEANING:
-		ret = sps30_write_then_read(state, buf, 2, NULL, 0);
-		break;
-	case SPS30_READ_AUTO_CLEANING_PERIOD:
-		buf[0] = SPS30_AUTO_CLEANING_PERIOD >> 8;
-		buf[1] = (u8)(SPS30_AUTO_CLEANING_PERIOD & 0xff);
-		/* fall through */
 	case SPS30_READ_DATA_READY_FLAG:
-	case SPS30_READ_DATA:
 	case SPS30_READ_SERIAL:
-		/* every two data bytes are checksummed */
-		size += size / 2;
-		ret = sps30_write_then_read(state, buf, 2, buf, size);
+	case SPS30_READ_VERSION:
+	case SPS30_READ_AUTO_CLEANING_PERIOD:
+	case SPS30_READ_DEVICE_STATUS:
+		retry = true;
 		break;
-	case SPS30_AUTO_CLEANING_PERIOD:
-		buf[2] = data[0];
-		buf[3] = data[1];
-		buf[4] = crc8(sps30_crc8_table, &buf[2], 2, CRC8_INIT_VALUE);
-		buf[5] = data[2];
-		buf[6] = data[3];
-		buf[7] = crc8(sps30_crc8_table, &buf[5], 2, CRC8_INIT_VALUE);
-		ret = sps30_write_then_read(state, buf, 8, NULL, 0);
+	default:
+		retry = false;
 		break;
 	}
 
-	if (ret)
-		return ret;
+	for (i = 0; ; i++) {
+		ret = __sps30_do_cmd(state, cmd, data, size);
+		if (!retry || i == SPS30_MAX_RETRIES ||
+		    !sps30_is_transient(ret))
+			break;
 
-	/* validate received data and strip off crc bytes */
-	for (i = 0; i < size; i += 3) {
-		u8 crc = crc8(sps30_crc8_table, &buf[i], 2, CRC8_INIT_VALUE);
+		state->counters[SPS30_CNT_RETRIES]++;
+	}
 
-		if (crc != buf[i + 2]) {
-			dev_err(&state->client->dev,
-				"data integrity check failed\n");
-			return -EIO;
-		}
+	return ret;
+}
+
+static int sps30_do_cmd_reset(struct sps30_state *state)
+{
+	int ret;
 
-		*data++ = buf[i];
-		*data++ = buf[i + 1];
+	ret = sps30_do_cmd(state, SPS30_RESET, NULL, 0);
+	msleep(300);
+	/*
+	 * Power-on-reset causes sensor to produce some glitch on i2c bus and
+	 * some controllers end up in error state. Recover simply by placing
+	 * some data on the bus, for example STOP_MEAS command, which
+	 * is NOP in this case.
+	 */
+	sps30_do_cmd(state, SPS30_STOP_MEAS, NULL, 0);
+	state->state = RESET;
+	/* reset is only taken while awake */
+	if (!ret) {
+		state->asleep = false;
+		state->auto_cleaned_ts = ktime_get();
 	}
 
-	return 0;
+	spin_lock(&state->frame_lock);
+	state->frame_len = 0;
+	spin_unlock(&state->frame_lock);
+
+	return ret;
 }
 
-static s32 sps30_float_to_int_clamped(const u8 *fp)
+/* converts float to units of 1 / res, rounding down */
+VISIBLE_IF_KUNIT s32 sps30_float_to_int_clamped(const u8 *fp, u32 res)
 {
-	int val = get_unaligned_be32(fp);
-	int mantissa = val & GENMASK(22, 0);
+	u32 val = get_unaligned_be32(fp);
+	u64 mantissa = BIT(23) | (val & GENMASK(22, 0));
 	/* this is fine since passed float is always non-negative */
-	int exp = val >> 23;
-	int fraction, shift;
+	int exp = (int)(val >> 23) - 127;
 
-	/* special case 0 */
-	if (!exp && !mantissa)
+	/* 0 and denormals, which are far below resolution anyway */
+	if (exp < -126)
 		return 0;
 
-	exp -= 127;
-	if (exp < 0) {
-		/* return values ranging from 1 to 99 */
-		return ((((1 << 23) + mantissa) * 100) >> 23) >> (-exp);
-	}
-
-	/* return values ranging from 100 to 300000 */
-	shift = 23 - exp;
-	val = (1 << exp) + (mantissa >> shift);
-	if (val >= SPS30_MAX_PM)
-		return SPS30_MAX_PM * 100;
+	/* 4096 and above, infinity and NaN */
+	if (exp > 11)
+		return SPS30_MAX_PM * res;
 
-	fraction = mantissa & GENMASK(shift - 1, 0);
+	/*
+	 * Float equals mantissa * 2 ^ (exp - 23). Product takes up at most
+	 * 38 bits, so scaling before the shift keeps every bit of precision.
+	 */
+	mantissa = (mantissa * res) >> min(23 - exp, 63);
 
-	return val * 100 + ((fraction * 100) >> shift);
+	return min_t(u64, mantissa, SPS30_MAX_PM * res);
 }
+EXPORT_SYMBOL_IF_KUNIT(sps30_float_to_int_clamped);
 
-static int sps30_do_meas(struct sps30_state *state, s32 *data, int size)
+VISIBLE_IF_KUNIT s32 sps30_uint16_to_int_clamped(const u8 *buf, int index,
+						 u32 res)
 {
-	int i, ret, tries = 5;
-	u8 tmp[16];
+	int val = get_unaligned_be16(buf);
 
-	if (state->state == RESET) {
-		ret = sps30_do_cmd(state, SPS30_START_MEAS, NULL, 0);
-		if (ret)
-			return ret;
+	/* typical particle size is reported in nanometers */
+	if (index == TPS)
+		return val / 10;
 
-		state->state = MEASURING;
-	}
+	return min(val, SPS30_MAX_PM) * res;
+}
+EXPORT_SYMBOL_IF_KUNIT(sps30_uint16_to_int_clamped);
 
-	while (tries--) {
-		ret = sps30_do_cmd(state, SPS30_READ_DATA_READY_FLAG, tmp, 2);
-		if (ret)
-			return -EIO;
+/*
+ * Converts measurements and, if they come checksummed, verifies them in
+ * the same pass over the frame.
+ */
+VISIBLE_IF_KUNIT int sps30_decode(const u8 *raw, s32 *meas, int size,
+				  bool uint16_format, bool crc, u32 res)
+{
+	int i, word = crc ? 3 : 2;
+	u8 fp[4];
 
-		/* new measurements ready to be read */
-		if (tmp[1] == 1)
-			break;
+	if (uint16_format) {
+		for (i = 0; i < size; i++, raw += word) {
+			if (crc && sps30_crc_word(raw) != raw[2])
+				return -EBADMSG;
+
+			meas[i] = sps30_uint16_to_int_clamped(raw, i, res);
+		}
 
-		msleep_interruptible(300);
+		return 0;
 	}
 
-	if (tries == -1)
-		return -ETIMEDOUT;
+	for (i = 0; i < size; i++, raw += 2 * word) {
+		if (crc && (sps30_crc_word(raw) != raw[2] ||
+			    sps30_crc_word(raw + 3) != raw[5]))
+			return -EBADMSG;
+
+		fp[0] = raw[0];
+		fp[1] = raw[1];
+		fp[2] = raw[word];
+		fp[3] = raw[word + 1];
+		meas[i] = sps30_float_to_int_clamped(fp, i == TPS ?
+						     SPS30_TPS_RES : res);
+	}
 
-	ret = sps30_do_cmd(state, SPS30_READ_DATA, tmp, sizeof(int) * size);
-	if (ret)
-		return ret;
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(sps30_decode);
 
-	for (i = 0; i < size; i++)
-		data[i] = sps30_float_to_int_clamped(&tmp[4 * i]);
+static int sps30_decode_frame(struct sps30_state *state, const u8 *raw,
+			      s32 *meas, int size)
+{
+	if (sps30_decode(raw, meas, size, state->uint16_format,
+			 state->ops->raw_meas, state->res))
+		return sps30_bad_msg(state);
 
 	return 0;
 }
 
-#ifdef CONFIG_IIO_BUFFER
-static irqreturn_t sps30_trigger_handler(int irq, void *p)
+/*
+ * Reads and converts size measurements. Retried as a whole, so that frames
+ * failing verification are read again just like garbled transfers.
+ */
+static int sps30_read_meas(struct sps30_state *state, s32 *meas, int size)
 {
-	struct iio_poll_func *pf = p;
-	struct iio_dev *indio_dev = pf->indio_dev;
-	struct sps30_state *state = iio_priv(indio_dev);
-	int ret;
-	s32 data[4 + 2]; /* PM1, PM2P5, PM4, PM10, timestamp */
+	int i, ret, width = state->uint16_format ? sizeof(u16) : sizeof(u32);
+	u8 raw[SPS30_MAX_RAW_SIZE];
+
+	for (i = 0; ; i++) {
+		ret = __sps30_do_cmd(state, SPS30_READ_DATA, raw, width * size);
+		if (!ret)
+			ret = sps30_decode_frame(state, raw, meas, size);
+		if (!ret || i == SPS30_MAX_RETRIES || !sps30_is_transient(ret))
+			break;
 
-	mutex_lock(&state->lock);
-	ret = sps30_do_meas(state, data, 4);
-	mutex_unlock(&state->lock);
-	if (ret)
-		goto err;
+		state->counters[SPS30_CNT_RETRIES]++;
+	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-	/* Sensirion backwards compatibility code */
-	iio_push_to_buffers(indio_dev, data);
-#else /* LINUX_VERSION_CODE >= 4.8.0 */
-	iio_push_to_buffers_with_timestamp(indio_dev, data,
-					   iio_get_time_ns(indio_dev));
-#endif /* LINUX_VERSION_CODE < 4.8.0 */
-err:
-	iio_trigger_notify_done(indio_dev->trig);
+	return ret;
+}
 
-	return IRQ_HANDLED;
+/* whether frames are pulled off the sensor in the background */
+static bool sps30_sampling(struct sps30_state *state)
+{
+	return state->continuous || state->trig_enabled || state->osr > 1 ||
+	       state->ev_enabled;
 }
-#endif /* CONFIG_IIO_BUFFER */
 
-static int sps30_read_raw(struct iio_dev *indio_dev,
-			  struct iio_chan_spec const *chan,
-			  int *val, int *val2, long mask)
+/* shortest prefix of the frame covering all enabled channels */
+static int sps30_scan_size(struct iio_dev *indio_dev)
 {
-	struct sps30_state *state = iio_priv(indio_dev);
-	int data[4], ret = -EINVAL;
+	int bit = find_last_bit(indio_dev->active_scan_mask, TPS + 1);
 
-	switch (mask) {
-	case IIO_CHAN_INFO_PROCESSED:
-		switch (chan->type) {
-		case IIO_MASSCONCENTRATION:
-			mutex_lock(&state->lock);
-			/* read up to the number of bytes actually needed */
-			switch (chan->channel2) {
-			case IIO_MOD_PM1:
-				ret = sps30_do_meas(state, data, 1);
-				break;
-			case IIO_MOD_PM2P5:
-				ret = sps30_do_meas(state, data, 2);
-				break;
-			case IIO_MOD_PM4:
-				ret = sps30_do_meas(state, data, 3);
-				break;
-			case IIO_MOD_PM10:
-				ret = sps30_do_meas(state, data, 4);
-				break;
-			}
-			mutex_unlock(&state->lock);
-			if (ret)
-				return ret;
+	/* timestamp alone still needs a frame to be read */
+	return bit > TPS ? 1 : bit + 1;
+}
 
-			*val = data[chan->address] / 100;
-			*val2 = (data[chan->address] % 100) * 10000;
+/*
+ * Frames pulled off the sensor in the background go to the history, the
+ * averages and event checks, which all need whole frames. Buffered capture
+ * on its own needs no more than the enabled channels.
+ */
+static int sps30_sample_size(struct sps30_state *state)
+{
+	if (state->continuous || state->osr > 1 || state->ev_enabled ||
+	    state->watermark > 1 || !state->trig_enabled)
+		return ARRAY_SIZE(state->frame.meas);
 
-			return IIO_VAL_INT_PLUS_MICRO;
-		default:
-			return -EINVAL;
-		}
-	case IIO_CHAN_INFO_SCALE:
-		switch (chan->type) {
-		case IIO_MASSCONCENTRATION:
-			switch (chan->channel2) {
-			case IIO_MOD_PM1:
-			case IIO_MOD_PM2P5:
-			case IIO_MOD_PM4:
-			case IIO_MOD_PM10:
-				*val = 0;
-				*val2 = 10000;
-
-				return IIO_VAL_INT_PLUS_MICRO;
-			default:
-				return -EINVAL;
-			}
-		default:
-			return -EINVAL;
-		}
-	}
+	return sps30_scan_size(state->indio_dev);
+}
 
-	return -EINVAL;
+static bool sps30_cleaning(struct sps30_state *state)
+{
+	return ktime_before(ktime_get(), state->clean_until);
 }
 
-static int sps30_do_cmd_reset(struct sps30_state *state)
+static void sps30_mark_cleaning(struct sps30_state *state, ktime_t start)
 {
-	int ret;
+	spin_lock(&state->frame_lock);
+	state->cleaned_ts = start;
+	state->clean_until = ktime_add_ms(start, SPS30_CLEANING_MS);
+	state->counters[SPS30_CNT_CLEANINGS]++;
+	spin_unlock(&state->frame_lock);
+}
 
-	ret = sps30_do_cmd(state, SPS30_RESET, NULL, 0);
-	msleep(300);
-	/*
-	 * Power-on-reset causes sensor to produce some glitch on i2c bus and
-	 * some controllers end up in error state. Recover simply by placing
-	 * some data on the bus, for example STOP_MEAS command, which
-	 * is NOP in this case.
-	 */
-	sps30_do_cmd(state, SPS30_STOP_MEAS, NULL, 0);
-	state->state = RESET;
+/* whether the sensor may have started cleaning the fan on its own */
+static bool sps30_auto_cleaning_due(struct sps30_state *state, ktime_t now)
+{
+	s64 period = SPS30_AUTO_CLEANING_PERIOD_DEFAULT;
 
-	return ret;
+	if (READ_ONCE(state->cleaning_period_valid))
+		period = READ_ONCE(state->cleaning_period);
+	if (!period)
+		return false;
+
+	/* sensor clock may run a little fast, allow for a percent */
+	return ktime_ms_delta(now, state->auto_cleaned_ts) >=
+	       period * (MSEC_PER_SEC - 10);
 }
 
-static ssize_t start_cleaning_store(struct device *dev,
-				    struct device_attribute *attr,
-				    const char *buf, size_t len)
+static bool sps30_frame_is_fresh(struct sps30_state *state, int size)
 {
-	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
-	struct sps30_state *state = iio_priv(indio_dev);
-	int val, ret;
+	s64 age;
 
-	if (kstrtoint(buf, 0, &val) || val != 1)
-		return -EINVAL;
+	if (state->frame_len < size)
+		return false;
 
-	mutex_lock(&state->lock);
-	ret = sps30_do_cmd(state, SPS30_START_FAN_CLEANING, NULL, 0);
-	mutex_unlock(&state->lock);
-	if (ret)
-		return ret;
+	age = ktime_ms_delta(ktime_get(), state->frame.ts);
+	/* sampling work keeps the frame current, tolerate a late run */
+	if (sps30_sampling(state) && age < 2 * SPS30_MEAS_PERIOD_MS)
+		return true;
 
-	return len;
+	return age < state->cache_max_age_ms;
 }
 
-static ssize_t cleaning_period_show(struct device *dev,
-				      struct device_attribute *attr,
-				      char *buf)
+static int sps30_wait_init(struct sps30_state *state)
 {
-	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
-	struct sps30_state *state = iio_priv(indio_dev);
-	u8 tmp[4];
 	int ret;
 
-	mutex_lock(&state->lock);
-	ret = sps30_do_cmd(state, SPS30_READ_AUTO_CLEANING_PERIOD, tmp, 4);
-	mutex_unlock(&state->lock);
+	ret = wait_for_completion_interruptible(&state->init_done);
 	if (ret)
 		return ret;
 
-	return sprintf(buf, "%d\n", get_unaligned_be32(tmp));
+	return state->init_err;
 }
 
-static ssize_t cleaning_period_store(struct device *dev,
-				       struct device_attribute *attr,
-				       const char *buf, size_t len)
+/* keeps the sensor awake and measuring until the matching put */
+static int sps30_pm_get(struct sps30_state *state)
 {
-	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
-	struct sps30_state *state = iio_priv(indio_dev);
-	int val, ret;
-	u8 tmp[4];
-
-	if (kstrtoint(buf, 0, &val))
-		return -EINVAL;
-
-	if ((val < SPS30_AUTO_CLEANING_PERIOD_MIN) ||
-	    (val > SPS30_AUTO_CLEANING_PERIOD_MAX))
-		return -EINVAL;
+	struct device *dev = state->dev;
+	int ret;
 
-	put_unaligned_be32(val, tmp);
+	/* everything talking to the sensor comes here first */
+	ret = sps30_wait_init(state);
+	if (ret)
+		return ret;
 
-	mutex_lock(&state->lock);
-	ret = sps30_do_cmd(state, SPS30_AUTO_CLEANING_PERIOD, tmp, 0);
-	if (ret) {
-		mutex_unlock(&state->lock);
+	ret = pm_runtime_get_sync(dev);
+	if (ret < 0) {
+		pm_runtime_put_noidle(dev);
 		return ret;
 	}
 
-	msleep(20);
-
-	/*
-	 * sensor requires reset in order to return up to date self cleaning
-	 * period
-	 */
-	ret = sps30_do_cmd_reset(state);
-	if (ret)
-		dev_warn(dev,
-			 "period changed but reads will return the old value\n");
+	return 0;
+}
 
-	mutex_unlock(&state->lock);
+static void sps30_pm_put(struct sps30_state *state)
+{
+	struct device *dev = state->dev;
 
-	return len;
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
 }
 
-static ssize_t cleaning_period_available_show(struct device *dev,
-					      struct device_attribute *attr,
-					      char *buf)
+/* called with lock held */
+static int sps30_wakeup(struct sps30_state *state)
 {
-	return snprintf(buf, PAGE_SIZE, "[%d %d %d]\n",
-			SPS30_AUTO_CLEANING_PERIOD_MIN, 1,
-			SPS30_AUTO_CLEANING_PERIOD_MAX);
+	int ret;
+
+	if (!state->asleep)
+		return 0;
+
+	/* first command may only wake up the interface, unacked */
+	ret = sps30_do_cmd(state, SPS30_WAKEUP, NULL, 0);
+	if (ret)
+		ret = sps30_do_cmd(state, SPS30_WAKEUP, NULL, 0);
+	if (ret)
+		return ret;
+
+	state->asleep = false;
+	usleep_range(5000, 6000);
+
+	return 0;
+}
+
+static int sps30_start_meas(struct sps30_state *state)
+{
+	int ret = 0;
+
+	mutex_lock(&state->lock);
+	/* resume may have failed to wake the sensor, try again */
+	if (state->state == RESET)
+		ret = sps30_wakeup(state);
+	if (!ret && state->state == RESET) {
+		ret = sps30_do_cmd(state, SPS30_START_MEAS, NULL, 0);
+		if (!ret) {
+			state->state = MEASURING;
+			/* frames follow a new cadence after restart */
+			state->sched.synced = false;
+		}
+	}
+	mutex_unlock(&state->lock);
+
+	return ret;
+}
+
+static int sps30_data_ready(struct sps30_state *state)
+{
+	u8 tmp[2];
+	int ret;
+
+	mutex_lock(&state->lock);
+	ret = sps30_do_cmd(state, SPS30_READ_DATA_READY_FLAG, tmp, 2);
+	mutex_unlock(&state->lock);
+	if (ret)
+		return -EIO;
+
+	return tmp[1] == 1;
+}
+
+/* called with frame_lock held */
+static void sps30_reset_avg(struct sps30_state *state)
+{
+	memset(state->acc, 0, sizeof(state->acc));
+	state->acc_n = 0;
+	state->ema_primed = false;
+	state->avg_valid = false;
+}
+
+/* feeds a frame to the averaging, returns true once a block is complete */
+static bool sps30_reduce(struct sps30_state *state,
+			 const struct sps30_frame *frame)
+{
+	unsigned int i, n = state->osr;
+
+	if (n == 1)
+		return true;
+
+	for (i = 0; i < ARRAY_SIZE(frame->meas); i++) {
+		if (state->osr_mode == SPS30_OSR_MEAN)
+			state->acc[i] += frame->meas[i];
+		else if (state->ema_primed)
+			state->acc[i] += frame->meas[i] -
+					 div_s64(state->acc[i], n);
+		else
+			/* accumulator holds average scaled by the ratio */
+			state->acc[i] = (s64)frame->meas[i] * n;
+	}
+	state->ema_primed = true;
+
+	if (++state->acc_n < n)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(frame->meas); i++) {
+		state->avg.meas[i] = div_s64(state->acc[i], n);
+		if (state->osr_mode == SPS30_OSR_MEAN)
+			state->acc[i] = 0;
+	}
+	state->avg.ts = frame->ts;
+	state->avg_valid = true;
+	state->acc_n = 0;
+
+	return true;
+}
+
+/* moves monotonic timestamp over to the clock selected for the device */
+static s64 sps30_iio_time(struct iio_dev *indio_dev, ktime_t ts)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	/* Sensirion backwards compatibility code */
+	return iio_get_time_ns() - ktime_to_ns(ktime_sub(ktime_get(), ts));
+#else /* LINUX_VERSION_CODE >= 4.8.0 */
+	return iio_get_time_ns(indio_dev) -
+	       ktime_to_ns(ktime_sub(ktime_get(), ts));
+#endif /* LINUX_VERSION_CODE < 4.8.0 */
+}
+
+/* evaluates thresholds against a new frame, called with frame_lock held */
+static void sps30_check_events(struct sps30_state *state,
+			       const struct sps30_frame *frame)
+{
+	struct iio_dev *indio_dev = state->indio_dev;
+	unsigned long enabled = state->ev_enabled;
+	int i, dir, bit;
+	s32 val, thresh;
+
+	for_each_set_bit(bit, &enabled, 2 * (PM10 + 1)) {
+		i = bit / 2;
+		dir = bit % 2;
+		/* falling thresholds are handled as rising on negated values */
+		val = dir ? -frame->meas[i] : frame->meas[i];
+		thresh = dir ? -state->thresh[i][dir] : state->thresh[i][dir];
+
+		if (test_bit(bit, &state->ev_fired)) {
+			/* re-arm once value is back past the hysteresis */
+			if (val < thresh - state->hyst[i][dir])
+				clear_bit(bit, &state->ev_fired);
+			continue;
+		}
+
+		if (val <= thresh)
+			continue;
+
+		set_bit(bit, &state->ev_fired);
+		iio_push_event(indio_dev,
+			       IIO_MOD_EVENT_CODE(IIO_MASSCONCENTRATION, 0,
+						  sps30_pm_mods[i],
+						  IIO_EV_TYPE_THRESH,
+						  dir ? IIO_EV_DIR_FALLING :
+							IIO_EV_DIR_RISING),
+			       sps30_iio_time(indio_dev, frame->ts));
+	}
+}
+
+static int sps30_read_frame(struct sps30_state *state, int size)
+{
+	struct iio_dev *indio_dev = state->indio_dev;
+	struct sps30_frame frame = { };
+	int ret;
+
+	/* frame stays there until the next one so it can be read again */
+	mutex_lock(&state->lock);
+	ret = sps30_read_meas(state, frame.meas, size);
+	mutex_unlock(&state->lock);
+	state->sched.consumed = ktime_get();
+	if (ret)
+		return ret;
+
+	frame.ts = state->ready_ts;
+	state->stats.frames++;
+
+	spin_lock(&state->frame_lock);
+	state->frame = frame;
+	state->frame_len = size;
+	state->sample_seq++;
+	/* partial frames are only read for buffered capture without osr */
+	state->reduced = state->osr == 1;
+	if (size > PM10)
+		sps30_check_events(state, &frame);
+	if (size == ARRAY_SIZE(frame.meas)) {
+		/* drop the oldest frame to make room for the new one */
+		if (kfifo_is_full(&state->ring))
+			kfifo_skip(&state->ring);
+		kfifo_put(&state->ring, frame);
+		state->reduced = sps30_reduce(state, &frame);
+	}
+	spin_unlock(&state->frame_lock);
+
+	sysfs_notify(&indio_dev->dev.kobj, NULL, "sample_seq");
+
+	return 0;
+}
+
+/* predicted arrival of the first frame not read out yet, 0 if unknown */
+static ktime_t sps30_sched_next(struct sps30_sched *sched)
+{
+	s64 k;
+
+	if (!sched->synced)
+		return 0;
+
+	k = div64_s64(ktime_to_ns(ktime_sub(sched->consumed, sched->anchor)),
+		      sched->period_ns);
+
+	return ktime_add_ns(sched->anchor,
+			    (max_t(s64, k, 0) + 1) * sched->period_ns);
+}
+
+static enum hrtimer_restart sps30_sched_timer(struct hrtimer *timer)
+{
+	struct sps30_sched *sched = container_of(timer, struct sps30_sched,
+						 timer);
+	struct sps30_state *state = container_of(sched, struct sps30_state,
+						 sched);
+
+	WRITE_ONCE(sched->expired, true);
+	wake_up_all(&sched->wq);
+
+	if (READ_ONCE(sched->kick))
+		mod_delayed_work(system_wq, &state->sample_work, 0);
+
+	return HRTIMER_NORESTART;
+}
+
+static void sps30_sched_arm(struct sps30_state *state, ktime_t expires,
+			    bool kick)
+{
+	struct sps30_sched *sched = &state->sched;
+
+	WRITE_ONCE(sched->expired, false);
+	WRITE_ONCE(sched->kick, kick);
+	hrtimer_start(&sched->timer, expires, HRTIMER_MODE_ABS);
+}
+
+/* returns -ERESTARTSYS if interrupted by a signal, 0 otherwise */
+static int sps30_sched_sleep(struct sps30_state *state, ktime_t expires)
+{
+	struct sps30_sched *sched = &state->sched;
+	long ret;
+
+	sps30_sched_arm(state, expires, false);
+	/* timeout only guards against timer being cancelled underneath */
+	ret = wait_event_interruptible_timeout(sched->wq,
+			READ_ONCE(sched->expired),
+			msecs_to_jiffies(SPS30_DATA_READY_TIMEOUT_MS));
+
+	return ret < 0 ? ret : 0;
+}
+
+static void sps30_sched_learn(struct sps30_sched *sched, ktime_t arrival)
+{
+	s64 delta, k;
+
+	delta = ktime_to_ns(ktime_sub(arrival, sched->anchor));
+	k = div64_s64(delta + sched->period_ns / 2, sched->period_ns);
+	if (k <= 0 || k > SPS30_SCHED_MAX_GAP)
+		return;
+
+	sched->period_ns += (div64_s64(delta, k) - sched->period_ns) / 8;
+	/* sensor clock is within a few percent of nominal */
+	sched->period_ns = clamp_t(s64, sched->period_ns,
+				   SPS30_MEAS_PERIOD_NS / 100 * 95,
+				   SPS30_MEAS_PERIOD_NS / 100 * 105);
+}
+
+/* latest predicted frame arrival not after the given time */
+static ktime_t sps30_sched_grid(struct sps30_sched *sched, ktime_t t)
+{
+	s64 k;
+
+	k = div64_s64(ktime_to_ns(ktime_sub(t, sched->anchor)),
+		      sched->period_ns);
+
+	return ktime_add_ns(sched->anchor, k * sched->period_ns);
+}
+
+/* updates the model with a frame seen at the given time, returns arrival */
+static ktime_t sps30_sched_frame(struct sps30_sched *sched, ktime_t now,
+				 bool hit)
+{
+	ktime_t est;
+
+	if (hit) {
+		/* frame arrived some time before the poll, assume on time */
+		est = ktime_sub_us(sps30_sched_grid(sched, now),
+				   SPS30_SCHED_CREEP_US);
+	} else if (ktime_after(sched->polled, sched->consumed) &&
+		   ktime_ms_delta(now, sched->polled) <=
+		   2 * SPS30_SCHED_STEP_MS) {
+		/* frame arrived in between two closely spaced polls */
+		est = now;
+		if (sched->synced)
+			sps30_sched_learn(sched, est);
+	} else {
+		/*
+		 * Arrival time is unknown, stick to what was learned so far
+		 * and report the best guess.
+		 */
+		if (sched->synced) {
+			est = sps30_sched_grid(sched, now);
+			if (ktime_after(est, sched->consumed) &&
+			    ktime_after(est, sched->polled))
+				return est;
+		}
+
+		return now;
+	}
+
+	sched->anchor = est;
+	sched->synced = true;
+
+	return est;
+}
+
+/*
+ * Polls data-ready flag once and feeds the outcome to the scheduler. Returns
+ * 1 if new frame is ready, 0 if not and negative error code otherwise.
+ */
+static int sps30_sched_poll(struct sps30_state *state, bool predicted)
+{
+	struct sps30_sched *sched = &state->sched;
+	ktime_t now;
+	int ret;
+
+	state->stats.polls++;
+	ret = sps30_data_ready(state);
+	trace_sps30_poll(state->dev, predicted, ret);
+	if (ret < 0)
+		return ret;
+
+	/* measurement restarted since the prediction was made */
+	predicted = predicted && sched->synced;
+	now = ktime_get();
+	if (ret) {
+		if (predicted)
+			state->counters[SPS30_CNT_PRED_HITS]++;
+		state->ready_ts = sps30_sched_frame(sched, now, predicted);
+	} else {
+		if (predicted)
+			state->counters[SPS30_CNT_PRED_MISSES]++;
+		sched->polled = now;
+	}
+
+	return ret;
+}
+
+/* sleeps until the slot of the sensor within the bus schedule comes up */
+static int sps30_bus_align(struct sps30_state *state)
+{
+	struct sps30_bus *bus = state->bus;
+	ktime_t now = ktime_get(), slot;
+	s64 delta, k = 0;
+
+	if (!bus || READ_ONCE(state->state) != RESET)
+		return 0;
+
+	slot = ktime_add_ns(bus->epoch, READ_ONCE(state->slot_ns));
+	delta = ktime_to_ns(ktime_sub(now, slot));
+	if (delta > 0)
+		k = div64_s64(delta, SPS30_MEAS_PERIOD_NS) + 1;
+
+	/* frames follow START_MEAS at a fixed delay, so align the start */
+	return sps30_sched_sleep(state,
+				 ktime_add_ns(slot, k * SPS30_MEAS_PERIOD_NS));
+}
+
+static void sps30_bus_lock(struct sps30_state *state)
+{
+	if (state->bus)
+		mutex_lock(&state->bus->lock);
+}
+
+static void sps30_bus_unlock(struct sps30_state *state)
+{
+	if (state->bus)
+		mutex_unlock(&state->bus->lock);
+}
+
+/*
+ * Polls once and reads the frame out straight away if it is there, so that
+ * the mux does not have to switch in between. Returns 1 if a frame was read,
+ * 0 if none is ready yet and negative error code otherwise.
+ */
+static int sps30_poll_frame(struct sps30_state *state, bool predicted,
+			    int size)
+{
+	int ret;
+
+	sps30_bus_lock(state);
+	ret = sps30_sched_poll(state, predicted);
+	if (ret > 0) {
+		ret = sps30_read_frame(state, size);
+		if (!ret)
+			ret = 1;
+	}
+	sps30_bus_unlock(state);
+
+	return ret;
+}
+
+static int sps30_wait_frame(struct sps30_state *state, int size)
+{
+	struct sps30_sched *sched = &state->sched;
+	unsigned int step = SPS30_SCHED_STEP_MS;
+	ktime_t next, deadline;
+	bool predicted;
+	int ret;
+
+	deadline = ktime_add_ms(ktime_get(), SPS30_DATA_READY_TIMEOUT_MS);
+	next = sps30_sched_next(sched);
+	predicted = next != 0;
+	if (predicted && ktime_after(next, ktime_get())) {
+		ret = sps30_sched_sleep(state,
+					ktime_add_us(next,
+						     SPS30_SCHED_MARGIN_US));
+		if (ret)
+			return ret;
+	}
+
+	/* fall back to polling if frame is not where it was expected */
+	for (;;) {
+		ret = sps30_poll_frame(state, predicted, size);
+		if (ret)
+			return ret < 0 ? ret : 0;
+
+		if (ktime_after(ktime_get(), deadline)) {
+			state->stats.timeouts++;
+			return -ETIMEDOUT;
+		}
+
+		ret = sps30_sched_sleep(state, ktime_add_ms(ktime_get(), step));
+		if (ret)
+			return ret;
+		/* keep resolution high until arrival of frames is known */
+		if (sched->synced)
+			step = min_t(unsigned int, step * 2,
+				     SPS30_SCHED_STEP_MAX_MS);
+		predicted = false;
+	}
+}
+
+/* arms the timer to kick sampling work once the next frame is due */
+static void sps30_sched_kick(struct sps30_state *state)
+{
+	struct sps30_sched *sched = &state->sched;
+	ktime_t now = ktime_get(), next;
+
+	next = sps30_sched_next(sched);
+	sched->predicted = next != 0 && ktime_after(next, now);
+	if (sched->predicted)
+		next = ktime_add_us(next, SPS30_SCHED_MARGIN_US);
+	else
+		next = ktime_add_ms(now, SPS30_SCHED_STEP_MS);
+	sps30_sched_arm(state, next, true);
+}
+
+/*
+ * Only one context at a time talks to the sensor about measurements. Others
+ * wait for the outcome and share it. Called with frame_lock held once the
+ * fetch is over. Got tells whether a frame or an error is to be shared.
+ */
+static void sps30_fetch_done(struct sps30_state *state, int ret, bool got)
+{
+	state->fetching = false;
+	if (got) {
+		state->fetch_err = ret;
+		state->fetch_seq++;
+	}
+
+	/* whoever fetched also keeps background sampling going */
+	if (!sps30_sampling(state)) {
+		WRITE_ONCE(state->sched.kick, false);
+	} else if (ret < 0) {
+		/* do not hammer the bus, try again with the next frame */
+		state->sched.predicted = false;
+		mod_delayed_work(system_wq, &state->sample_work,
+				 msecs_to_jiffies(SPS30_MEAS_PERIOD_MS));
+	} else {
+		sps30_sched_kick(state);
+	}
+
+	wake_up_all(&state->frame_wq);
+}
+
+/*
+ * Resets the sensor once measurements keep failing. Reset takes a while
+ * and may well not help so retries are spaced out exponentially. Called by
+ * whoever is fetching a frame.
+ */
+static void sps30_recover(struct sps30_state *state, int ret)
+{
+	ktime_t now = ktime_get();
+
+	if (ret >= 0) {
+		state->failures = 0;
+		state->backoff_ms = 0;
+		return;
+	}
+
+	/* automatic cleaning stops measurements, wait for it to finish */
+	if (ret == -ETIMEDOUT && state->state == MEASURING &&
+	    ktime_ms_delta(now, state->clean_until) > SPS30_CLEANING_GUARD_MS &&
+	    sps30_auto_cleaning_due(state, now)) {
+		state->auto_cleaned_ts = now;
+		sps30_mark_cleaning(state, now);
+		return;
+	}
+
+	if (++state->failures < SPS30_RECOVER_THRESHOLD ||
+	    ktime_before(now, state->recover_at))
+		return;
+
+	dev_warn(state->dev, "measurements keep failing, resetting\n");
+	state->counters[SPS30_CNT_RECOVERIES]++;
+
+	mutex_lock(&state->lock);
+	/* sensor left asleep by a failed resume ignores reset */
+	sps30_wakeup(state);
+	sps30_do_cmd_reset(state);
+	mutex_unlock(&state->lock);
+
+	state->failures = 0;
+	state->backoff_ms = clamp_t(unsigned int, state->backoff_ms * 2,
+				    SPS30_RECOVER_BACKOFF_MIN_MS,
+				    SPS30_RECOVER_BACKOFF_MAX_MS);
+	state->recover_at = ktime_add_ms(ktime_get(), state->backoff_ms);
+}
+
+static int sps30_fetch_frame(struct sps30_state *state, int size)
+{
+	int ret;
+
+	ret = sps30_bus_align(state);
+	if (ret)
+		return ret;
+
+	ret = sps30_start_meas(state);
+	if (ret)
+		return ret;
+
+	/*
+	 * With caching enabled read whole frame so that other channels hit,
+	 * unless the buffer is being filled, which takes enabled channels only.
+	 */
+	if (READ_ONCE(state->cache_max_age_ms) &&
+	    !iio_buffer_enabled(state->indio_dev))
+		size = ARRAY_SIZE(state->frame.meas);
+
+	return sps30_wait_frame(state, size);
+}
+
+static int sps30_do_meas(struct sps30_state *state, struct sps30_frame *frame,
+			 int size)
+{
+	ktime_t start = ktime_get();
+	bool fetched = false;
+	unsigned int seq;
+	int ret;
+
+	spin_lock(&state->frame_lock);
+	/* frame fetched on behalf of this call is good regardless of age */
+	while (!(fetched && state->frame_len >= size) &&
+	       !sps30_frame_is_fresh(state, size)) {
+		/* serve the last good frame until cleaning is over */
+		if (sps30_cleaning(state)) {
+			ret = -EBUSY;
+			if (state->frame_len < size)
+				goto out;
+			break;
+		}
+
+		if (!state->fetching) {
+			state->fetching = true;
+			spin_unlock(&state->frame_lock);
+			ret = sps30_fetch_frame(state, size);
+			/* leave the fetch to whoever waits for it */
+			if (ret == -ERESTARTSYS) {
+				spin_lock(&state->frame_lock);
+				sps30_fetch_done(state, 0, false);
+				goto out;
+			}
+			sps30_recover(state, ret);
+			spin_lock(&state->frame_lock);
+			sps30_fetch_done(state, ret, true);
+		} else {
+			seq = state->fetch_seq;
+			spin_unlock(&state->frame_lock);
+			ret = wait_event_interruptible(state->frame_wq,
+					!READ_ONCE(state->fetching) ||
+					READ_ONCE(state->fetch_seq) != seq);
+			spin_lock(&state->frame_lock);
+			if (ret)
+				goto out;
+			/* fetch gave up without a frame, take over */
+			if (state->fetch_seq == seq)
+				continue;
+			ret = state->fetch_err;
+		}
+
+		/* fetch may have found the sensor cleaning */
+		if (ret && sps30_cleaning(state))
+			continue;
+		if (ret)
+			goto out;
+
+		fetched = true;
+	}
+
+	*frame = state->frame;
+	ret = 0;
+out:
+	sps30_stats_hist(state->stats.meas_hist, start);
+	spin_unlock(&state->frame_lock);
+
+	return ret;
+}
+
+/*
+ * Returns the most recent averaged frame, waiting for one newer than
+ * the given time unless told otherwise. Sampling work does the averaging.
+ */
+static int sps30_read_avg(struct sps30_state *state, struct sps30_frame *frame,
+			  ktime_t after, bool nonblock)
+{
+	long timeout;
+	int ret = 0;
+
+	/* block of frames plus some slack for the first one to show up */
+	timeout = READ_ONCE(state->osr) * SPS30_MEAS_PERIOD_MS;
+	timeout = msecs_to_jiffies(timeout + SPS30_DATA_READY_TIMEOUT_MS);
+
+	spin_lock(&state->frame_lock);
+	while (!state->avg_valid ||
+	       (state->avg.ts == after && !sps30_cleaning(state))) {
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		spin_unlock(&state->frame_lock);
+		timeout = wait_event_interruptible_timeout(state->frame_wq,
+				READ_ONCE(state->avg_valid) &&
+				READ_ONCE(state->avg.ts) != after, timeout);
+		spin_lock(&state->frame_lock);
+		if (timeout < 0) {
+			ret = timeout;
+			goto out;
+		}
+		if (!timeout && (!state->avg_valid || state->avg.ts == after)) {
+			ret = -ETIMEDOUT;
+			goto out;
+		}
+	}
+
+	*frame = state->avg;
+out:
+	spin_unlock(&state->frame_lock);
+
+	return ret;
+}
+
+/* lets consumers know a new frame has been pulled off the sensor */
+static void sps30_notify_frame(struct sps30_state *state)
+{
+#ifdef CONFIG_IIO_BUFFER
+	/* trigger handler picks up the frame just read */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+	iio_trigger_poll_chained(state->trig);
+#else /* LINUX_VERSION_CODE >= 6.4.0 */
+	iio_trigger_poll_nested(state->trig);
+#endif /* LINUX_VERSION_CODE < 6.4.0 */
+#endif /* CONFIG_IIO_BUFFER */
+}
+
+/* fan cleaning only works while measuring */
+static int sps30_start_cleaning(struct sps30_state *state)
+{
+	ktime_t start;
+	int ret;
+
+	ret = sps30_start_meas(state);
+	if (ret)
+		return ret;
+
+	mutex_lock(&state->lock);
+	start = ktime_get();
+	ret = sps30_do_cmd(state, SPS30_START_FAN_CLEANING, NULL, 0);
+	mutex_unlock(&state->lock);
+	if (ret)
+		return ret;
+
+	sps30_mark_cleaning(state, start);
+
+	return 0;
+}
+
+static void sps30_clean_work(struct work_struct *work)
+{
+	struct sps30_state *state = container_of(to_delayed_work(work),
+						 struct sps30_state,
+						 clean_work);
+	unsigned int period = READ_ONCE(state->idle_cleaning_period);
+	unsigned long delay;
+	s64 since;
+
+	if (!period)
+		return;
+
+	since = ktime_ms_delta(ktime_get(), state->cleaned_ts) / MSEC_PER_SEC;
+	if (since < period) {
+		delay = msecs_to_jiffies((period - since) * MSEC_PER_SEC);
+		goto out;
+	}
+
+	/* wait for a lull in demand unless cleaning is long overdue */
+	delay = msecs_to_jiffies(SPS30_IDLE_CLEANING_RETRY_MS);
+	if (sps30_sampling(state) && since < 2 * (s64)period)
+		goto out;
+
+	if (sps30_pm_get(state))
+		goto out;
+
+	/* runtime suspend is held off until the fan is done */
+	if (!sps30_start_cleaning(state))
+		delay = msecs_to_jiffies(period * MSEC_PER_SEC);
+	sps30_pm_put(state);
+out:
+	queue_delayed_work(system_wq, &state->clean_work, delay);
+}
+
+static bool sps30_has_status(struct sps30_state *state)
+{
+	return (state->fw_major << 8 | state->fw_minor) >= SPS30_STATUS_MIN_FW;
+}
+
+static int sps30_read_status(struct sps30_state *state)
+{
+	u8 tmp[4];
+	int ret;
+
+	mutex_lock(&state->lock);
+	ret = sps30_do_cmd(state, SPS30_READ_DEVICE_STATUS, tmp, sizeof(tmp));
+	mutex_unlock(&state->lock);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(state->status, get_unaligned_be32(tmp));
+	state->status_ts = ktime_get();
+
+	return 0;
+}
+
+static void sps30_sample_work(struct work_struct *work)
+{
+	struct sps30_state *state = container_of(to_delayed_work(work),
+						 struct sps30_state,
+						 sample_work);
+	bool predicted, fire;
+	s64 delay;
+	int ret;
+
+	spin_lock(&state->frame_lock);
+	/* whoever is fetching right now keeps sampling going */
+	if (!sps30_sampling(state) || state->fetching) {
+		spin_unlock(&state->frame_lock);
+		return;
+	}
+	/* nothing new to read while the fan is cleaned, resume afterwards */
+	if (sps30_cleaning(state)) {
+		delay = ktime_ms_delta(state->clean_until, ktime_get());
+		spin_unlock(&state->frame_lock);
+		mod_delayed_work(system_wq, &state->sample_work,
+				 msecs_to_jiffies(delay));
+		return;
+	}
+	state->fetching = true;
+	predicted = state->sched.predicted;
+	spin_unlock(&state->frame_lock);
+
+	ret = sps30_bus_align(state);
+	if (!ret)
+		ret = sps30_start_meas(state);
+	if (!ret)
+		ret = sps30_poll_frame(state, predicted,
+				       sps30_sample_size(state));
+	if (ret)
+		sps30_recover(state, ret);
+	/* bus is quiet until the next frame, refresh the status meanwhile */
+	if (ret > 0 && sps30_has_status(state) &&
+	    ktime_ms_delta(ktime_get(), state->status_ts) >
+	    SPS30_STATUS_PERIOD_MS)
+		sps30_read_status(state);
+
+	spin_lock(&state->frame_lock);
+	sps30_fetch_done(state, min(ret, 0), ret != 0);
+	/* with oversampling consumers are notified once per block */
+	fire = ret > 0 && state->reduced && state->trig_enabled;
+	if (fire && state->osr == 1 && ++state->batch_n < state->watermark)
+		fire = false;
+	if (fire)
+		state->batch_n = 0;
+	spin_unlock(&state->frame_lock);
+
+	if (fire)
+		sps30_notify_frame(state);
+}
+
+#ifdef CONFIG_IIO_BUFFER
+/* same as sps30_do_meas() but returns -EAGAIN instead of waiting */
+static int sps30_do_meas_nonblock(struct sps30_state *state,
+				  struct sps30_frame *frame, int size)
+{
+	int ret;
+
+	spin_lock(&state->frame_lock);
+	/* serve a frame pulled off the sensor but not consumed yet */
+	if (sps30_frame_is_fresh(state, size) &&
+	    state->frame.ts != state->pushed_ts)
+		goto out;
+
+	/* sampling work starts measurement in the slot given by the bus */
+	if (state->fetching ||
+	    (state->bus && state->state == RESET && sps30_sampling(state))) {
+		spin_unlock(&state->frame_lock);
+		return -EAGAIN;
+	}
+	state->fetching = true;
+	spin_unlock(&state->frame_lock);
+
+	/* nobody else does, start in the slot, first frame is a second off */
+	if (state->bus && READ_ONCE(state->state) == RESET) {
+		ret = sps30_bus_align(state);
+		if (!ret)
+			ret = sps30_start_meas(state);
+
+		spin_lock(&state->frame_lock);
+		sps30_fetch_done(state, 0, false);
+		spin_unlock(&state->frame_lock);
+
+		return ret ? ret : -EAGAIN;
+	}
+
+	ret = sps30_start_meas(state);
+	if (!ret)
+		ret = sps30_poll_frame(state, false, size);
+
+	spin_lock(&state->frame_lock);
+	sps30_fetch_done(state, min(ret, 0), ret != 0);
+	if (ret <= 0) {
+		spin_unlock(&state->frame_lock);
+		return ret < 0 ? ret : -EAGAIN;
+	}
+out:
+	*frame = state->frame;
+	spin_unlock(&state->frame_lock);
+
+	return 0;
+}
+
+static void sps30_push_frame(struct iio_dev *indio_dev,
+			     const struct sps30_frame *frame)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	/* PM1 - PM10, NC0P5 - NC10, typical particle size, timestamp */
+	s32 data[10 + 2] __aligned(8);
+	int i = 0, bit;
+
+	/* buffer carries enabled channels only */
+	for_each_set_bit(bit, indio_dev->active_scan_mask, TPS + 1)
+		data[i++] = frame->meas[bit];
+
+	/* trace in hundredths regardless of resolution */
+	trace_sps30_push(state->dev, ktime_to_ns(frame->ts),
+			 frame->meas[PM2P5] / (state->res / 100));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	/* Sensirion backwards compatibility code */
+	iio_push_to_buffers(indio_dev, data);
+#else /* LINUX_VERSION_CODE >= 4.8.0 */
+	iio_push_to_buffers_with_timestamp(indio_dev, data,
+				sps30_iio_time(indio_dev, frame->ts));
+#endif /* LINUX_VERSION_CODE < 4.8.0 */
+}
+
+static bool sps30_batching(struct sps30_state *state)
+{
+	return state->trig_enabled && state->watermark > 1 && state->osr == 1;
+}
+
+/* pushes up to max frames from the ring which did not go out yet */
+static int sps30_push_pending(struct iio_dev *indio_dev, unsigned int max)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	unsigned int i, n, pushed = 0;
+
+	mutex_lock(&state->push_lock);
+	spin_lock(&state->frame_lock);
+	n = kfifo_out_peek(&state->ring, state->batch,
+			   kfifo_size(&state->ring));
+	spin_unlock(&state->frame_lock);
+
+	/* ring is ordered oldest first */
+	for (i = 0; i < n && !ktime_after(state->batch[i].ts,
+					  state->pushed_ts); i++)
+		;
+
+	for (; i < n && pushed < max; i++, pushed++) {
+		sps30_push_frame(indio_dev, &state->batch[i]);
+		state->pushed_ts = state->batch[i].ts;
+	}
+	mutex_unlock(&state->push_lock);
+
+	return pushed;
+}
+
+static irqreturn_t sps30_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct sps30_state *state = iio_priv(indio_dev);
+	struct sps30_frame frame;
+	int ret;
+
+	/* leave a gap instead of pushing frames disturbed by cleaning */
+	if (sps30_cleaning(state)) {
+		state->counters[SPS30_CNT_SKIPPED]++;
+		goto err;
+	}
+
+	if (sps30_batching(state)) {
+		state->counters[SPS30_CNT_PUSHED] +=
+			sps30_push_pending(indio_dev, UINT_MAX);
+		goto err;
+	}
+
+	if (READ_ONCE(state->osr) > 1)
+		ret = sps30_read_avg(state, &frame, state->pushed_ts,
+				     state->nonblocking);
+	else if (state->nonblocking)
+		ret = sps30_do_meas_nonblock(state, &frame,
+					     sps30_scan_size(indio_dev));
+	else
+		ret = sps30_do_meas(state, &frame, sps30_scan_size(indio_dev));
+
+	switch (ret) {
+	case 0:
+		state->counters[SPS30_CNT_PUSHED]++;
+		break;
+	case -EAGAIN:
+		state->counters[SPS30_CNT_SKIPPED]++;
+		goto err;
+	case -ETIMEDOUT:
+		state->counters[SPS30_CNT_TIMEDOUT]++;
+		goto err;
+	default:
+		goto err;
+	}
+
+	mutex_lock(&state->push_lock);
+	spin_lock(&state->frame_lock);
+	state->pushed_ts = frame.ts;
+	spin_unlock(&state->frame_lock);
+
+	sps30_push_frame(indio_dev, &frame);
+	mutex_unlock(&state->push_lock);
+err:
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static int sps30_set_trigger_state(struct iio_trigger *trig, bool enable)
+{
+	struct iio_dev *indio_dev = iio_trigger_get_drvdata(trig);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	spin_lock(&state->frame_lock);
+	state->trig_enabled = enable;
+	if (!sps30_sampling(state))
+		WRITE_ONCE(state->sched.kick, false);
+	spin_unlock(&state->frame_lock);
+
+	if (enable)
+		schedule_delayed_work(&state->sample_work, 0);
+
+	return 0;
+}
+
+static const struct iio_trigger_ops sps30_trigger_ops = {
+	.set_trigger_state = sps30_set_trigger_state,
+	.validate_device = iio_trigger_validate_own_device,
+};
+
+static int sps30_set_watermark(struct iio_dev *indio_dev, unsigned int val)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	spin_lock(&state->frame_lock);
+	/* batch cannot be any bigger than the ring */
+	state->watermark = clamp(val, 1U, kfifo_size(&state->ring));
+	state->batch_n = 0;
+	spin_unlock(&state->frame_lock);
+
+	return 0;
+}
+
+static int sps30_flush(struct iio_dev *indio_dev, unsigned int count)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	if (!sps30_batching(state))
+		return 0;
+
+	return sps30_push_pending(indio_dev, count);
+}
+
+/* sensor is kept measuring for as long as the buffer is enabled */
+static int sps30_buffer_preenable(struct iio_dev *indio_dev)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	/* frames read before the buffer got enabled are not pushed */
+	spin_lock(&state->frame_lock);
+	if (state->frame_len)
+		state->pushed_ts = state->frame.ts;
+	spin_unlock(&state->frame_lock);
+
+	return sps30_pm_get(state);
+}
+
+static int sps30_buffer_postdisable(struct iio_dev *indio_dev)
+{
+	sps30_pm_put(iio_priv(indio_dev));
+
+	return 0;
+}
+
+static const struct iio_buffer_setup_ops sps30_buffer_ops = {
+	.preenable = sps30_buffer_preenable,
+	.postdisable = sps30_buffer_postdisable,
+};
+#endif /* CONFIG_IIO_BUFFER */
+
+static int sps30_read_raw(struct iio_dev *indio_dev,
+			  struct iio_chan_spec const *chan,
+			  int *val, int *val2, long mask)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	struct sps30_frame frame;
+	s32 *data = frame.meas;
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_PROCESSED:
+		ret = sps30_pm_get(state);
+		if (ret)
+			return ret;
+
+		if (READ_ONCE(state->osr) > 1)
+			ret = sps30_read_avg(state, &frame, 0, false);
+		else
+			/* read up to the number of bytes actually needed */
+			ret = sps30_do_meas(state, &frame, chan->address + 1);
+		sps30_pm_put(state);
+		if (ret)
+			return ret;
+
+		switch (chan->address) {
+		case TPS:
+			/* sensor reports micrometers, channel is in meters */
+			*val = 0;
+			*val2 = data[TPS] * 10;
+
+			return IIO_VAL_INT_PLUS_NANO;
+		default:
+			*val = data[chan->address] / state->res;
+			*val2 = (data[chan->address] % state->res) *
+				(1000000 / state->res);
+
+			return IIO_VAL_INT_PLUS_MICRO;
+		}
+	case IIO_CHAN_INFO_SCALE:
+		switch (chan->address) {
+		case TPS:
+			*val = 0;
+			*val2 = 10;
+
+			return IIO_VAL_INT_PLUS_NANO;
+		default:
+			*val = 0;
+			*val2 = 1000000 / state->res;
+
+			return IIO_VAL_INT_PLUS_MICRO;
+		}
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*val = state->osr;
+
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		/* one value per block of frames */
+		*val = MSEC_PER_SEC / SPS30_MEAS_PERIOD_MS;
+		*val2 = state->osr;
+
+		return IIO_VAL_FRACTIONAL;
+	}
+
+	return -EINVAL;
+}
+
+static int sps30_write_raw(struct iio_dev *indio_dev,
+			   struct iio_chan_spec const *chan,
+			   int val, int val2, long mask)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	unsigned int old;
+	int ret;
+
+	if (mask != IIO_CHAN_INFO_OVERSAMPLING_RATIO)
+		return -EINVAL;
+
+	if (val < 1 || val > SPS30_OSR_MAX || val2)
+		return -EINVAL;
+
+	/* averaging is done in the background which keeps sensor awake */
+	if (val > 1) {
+		ret = sps30_pm_get(state);
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&state->frame_lock);
+	old = state->osr;
+	state->osr = val;
+	sps30_reset_avg(state);
+	if (!sps30_sampling(state))
+		WRITE_ONCE(state->sched.kick, false);
+	spin_unlock(&state->frame_lock);
+
+	if (val > 1)
+		schedule_delayed_work(&state->sample_work, 0);
+
+	/* drop the reference held so far, if any */
+	if (old > 1)
+		sps30_pm_put(state);
+
+	return 0;
+}
+
+static ssize_t start_cleaning_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int val, ret;
+
+	if (kstrtoint(buf, 0, &val) || val != 1)
+		return -EINVAL;
+
+	ret = sps30_pm_get(state);
+	if (ret)
+		return ret;
+
+	ret = sps30_start_cleaning(state);
+	sps30_pm_put(state);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t is_cleaning_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%d\n", sps30_cleaning(state));
+}
+
+static ssize_t idle_cleaning_period_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%u\n", state->idle_cleaning_period);
+}
+
+static ssize_t idle_cleaning_period_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > SPS30_AUTO_CLEANING_PERIOD_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(state->idle_cleaning_period, val);
+	mod_delayed_work(system_wq, &state->clean_work, 0);
+
+	return len;
+}
+
+static ssize_t cleaning_period_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	u8 tmp[4];
+	int ret;
+
+	ret = sps30_wait_init(state);
+	if (ret)
+		return ret;
+
+	if (READ_ONCE(state->cleaning_period_valid))
+		goto out;
+
+	ret = sps30_pm_get(state);
+	if (ret)
+		return ret;
+
+	mutex_lock(&state->lock);
+	ret = sps30_do_cmd(state, SPS30_READ_AUTO_CLEANING_PERIOD, tmp, 4);
+	if (!ret && !state->cleaning_period_valid) {
+		state->cleaning_period = get_unaligned_be32(tmp);
+		WRITE_ONCE(state->cleaning_period_valid, true);
+	}
+	mutex_unlock(&state->lock);
+	sps30_pm_put(state);
+	if (ret)
+		return ret;
+out:
+	return sprintf(buf, "%d\n", READ_ONCE(state->cleaning_period));
+}
+
+static ssize_t cleaning_period_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int val, ret;
+	u8 tmp[4];
+
+	if (kstrtoint(buf, 0, &val))
+		return -EINVAL;
+
+	if ((val < SPS30_AUTO_CLEANING_PERIOD_MIN) ||
+	    (val > SPS30_AUTO_CLEANING_PERIOD_MAX))
+		return -EINVAL;
+
+	put_unaligned_be32(val, tmp);
+
+	ret = sps30_pm_get(state);
+	if (ret)
+		return ret;
+
+	/*
+	 * New period is in effect right away but read back only after reset.
+	 * Rather than resetting the sensor and disrupting measurement keep
+	 * the value around.
+	 */
+	mutex_lock(&state->lock);
+	ret = sps30_do_cmd(state, SPS30_AUTO_CLEANING_PERIOD, tmp, 4);
+	if (!ret) {
+		WRITE_ONCE(state->cleaning_period, val);
+		WRITE_ONCE(state->cleaning_period_valid, true);
+	}
+	mutex_unlock(&state->lock);
+	sps30_pm_put(state);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t cleaning_period_available_show(struct device *dev,
+					      struct device_attribute *attr,
+					      char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "[%d %d %d]\n",
+			SPS30_AUTO_CLEANING_PERIOD_MIN, 1,
+			SPS30_AUTO_CLEANING_PERIOD_MAX);
+}
+
+static ssize_t serial_number_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int ret;
+
+	ret = sps30_wait_init(state);
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%s\n", state->serial);
+}
+
+static ssize_t firmware_version_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int ret;
+
+	ret = sps30_wait_init(state);
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%d.%d\n", state->fw_major, state->fw_minor);
+}
+
+static ssize_t device_status_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int ret;
+
+	ret = sps30_wait_init(state);
+	if (ret)
+		return ret;
+
+	if (!sps30_has_status(state))
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "0x%08x\n", READ_ONCE(state->status));
+}
+
+static ssize_t cache_max_age_ms_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%u\n", state->cache_max_age_ms);
+}
+
+static ssize_t cache_max_age_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > SPS30_CACHE_MAX_AGE_MAX)
+		return -EINVAL;
+
+	spin_lock(&state->frame_lock);
+	state->cache_max_age_ms = val;
+	spin_unlock(&state->frame_lock);
+
+	return len;
+}
+
+static ssize_t continuous_mode_show(struct device *dev,
+				    struct device_attribute *attr,
+				    char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%d\n", state->continuous);
+}
+
+static ssize_t continuous_mode_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	bool val, old, sampling;
+	int ret;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	/* continuous mode keeps the sensor awake */
+	if (val) {
+		ret = sps30_pm_get(state);
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&state->frame_lock);
+	old = state->continuous;
+	state->continuous = val;
+	sampling = sps30_sampling(state);
+	if (!sampling)
+		WRITE_ONCE(state->sched.kick, false);
+	spin_unlock(&state->frame_lock);
+
+	if (val)
+		schedule_delayed_work(&state->sample_work, 0);
+	else if (!sampling)
+		cancel_delayed_work_sync(&state->sample_work);
+
+	/* drop the reference held so far, if any */
+	if (old)
+		sps30_pm_put(state);
+
+	return len;
+}
+
+static ssize_t oversampling_mode_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%s\n", sps30_osr_modes[state->osr_mode]);
+}
+
+static ssize_t oversampling_mode_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	int mode;
+
+	for (mode = 0; mode < ARRAY_SIZE(sps30_osr_modes); mode++)
+		if (sysfs_streq(buf, sps30_osr_modes[mode]))
+			break;
+
+	if (mode == ARRAY_SIZE(sps30_osr_modes))
+		return -EINVAL;
+
+	spin_lock(&state->frame_lock);
+	if (state->osr_mode != mode) {
+		state->osr_mode = mode;
+		sps30_reset_avg(state);
+	}
+	spin_unlock(&state->frame_lock);
+
+	return len;
+}
+
+static ssize_t oversampling_mode_available_show(struct device *dev,
+						struct device_attribute *attr,
+						char *buf)
+{
+	return sprintf(buf, "%s %s\n", sps30_osr_modes[SPS30_OSR_MEAN],
+		       sps30_osr_modes[SPS30_OSR_EMA]);
+}
+
+static ssize_t oversampling_ratio_available_show(struct device *dev,
+						 struct device_attribute *attr,
+						 char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "[%d %d %d]\n", 1, 1, SPS30_OSR_MAX);
+}
+
+/* one line per frame: timestamp followed by all channels */
+static int sps30_format_frame(struct sps30_state *state, char *buf, int len,
+			      struct sps30_frame *frame)
+{
+	int i;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "%lld",
+			 ktime_to_ns(frame->ts));
+	for (i = 0; i < TPS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, " %d.%0*d",
+				 frame->meas[i] / state->res, state->decimals,
+				 frame->meas[i] % state->res);
+	len += scnprintf(buf + len, PAGE_SIZE - len, " %d.%02d",
+			 frame->meas[TPS] / SPS30_TPS_RES,
+			 frame->meas[TPS] % SPS30_TPS_RES);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static ssize_t snapshot_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	struct sps30_frame frame;
+	int ret;
+
+	ret = sps30_pm_get(state);
+	if (ret)
+		return ret;
+
+	if (READ_ONCE(state->osr) > 1)
+		ret = sps30_read_avg(state, &frame, 0, false);
+	else
+		ret = sps30_do_meas(state, &frame, ARRAY_SIZE(frame.meas));
+	sps30_pm_put(state);
+	if (ret)
+		return ret;
+
+	return sps30_format_frame(state, buf, 0, &frame);
+}
+
+static ssize_t sample_seq_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(state->sample_seq));
+}
+
+static ssize_t history_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	struct sps30_frame *frames;
+	int i, n, len = 0;
+
+	frames = kcalloc(kfifo_size(&state->ring), sizeof(*frames),
+			 GFP_KERNEL);
+	if (!frames)
+		return -ENOMEM;
+
+	spin_lock(&state->frame_lock);
+	n = kfifo_out_peek(&state->ring, frames, kfifo_size(&state->ring));
+	spin_unlock(&state->frame_lock);
+
+	/* newest first so that the most relevant data fits into a page */
+	for (i = n - 1; i >= 0; i--)
+		len = sps30_format_frame(state, buf, len, &frames[i]);
+
+	kfree(frames);
+
+	return len;
+}
+
+static ssize_t sps30_counter_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	struct iio_dev_attr *this_attr = to_iio_dev_attr(attr);
+
+	return sprintf(buf, "%u\n",
+		       READ_ONCE(state->counters[this_attr->address]));
+}
+
+static ssize_t nonblocking_capture_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return sprintf(buf, "%d\n", state->nonblocking);
+}
+
+static ssize_t nonblocking_capture_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t len)
+{
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct sps30_state *state = iio_priv(indio_dev);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	spin_lock(&state->frame_lock);
+	state->nonblocking = val;
+	spin_unlock(&state->frame_lock);
+
+	return len;
 }
 
 static IIO_DEVICE_ATTR_WO(start_cleaning, 0);
 static IIO_DEVICE_ATTR_RW(cleaning_period, 0);
 static IIO_DEVICE_ATTR_RO(cleaning_period_available, 0);
+static IIO_DEVICE_ATTR_RO(is_cleaning, 0);
+static IIO_DEVICE_ATTR_RW(idle_cleaning_period, 0);
+static IIO_DEVICE_ATTR(cleanings, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_CLEANINGS);
+static IIO_DEVICE_ATTR_RO(serial_number, 0);
+static IIO_DEVICE_ATTR_RO(firmware_version, 0);
+static IIO_DEVICE_ATTR_RO(device_status, 0);
+static IIO_DEVICE_ATTR_RW(cache_max_age_ms, 0);
+static IIO_DEVICE_ATTR_RW(continuous_mode, 0);
+static IIO_DEVICE_ATTR_RO(history, 0);
+static IIO_DEVICE_ATTR_RO(snapshot, 0);
+static IIO_DEVICE_ATTR_RO(sample_seq, 0);
+static IIO_DEVICE_ATTR_RW(oversampling_mode, 0);
+static IIO_DEVICE_ATTR_RO(oversampling_mode_available, 0);
+static IIO_DEVICE_ATTR_RO(oversampling_ratio_available, 0);
+static IIO_DEVICE_ATTR(frame_prediction_hits, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_PRED_HITS);
+static IIO_DEVICE_ATTR(frame_prediction_misses, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_PRED_MISSES);
+static IIO_DEVICE_ATTR_RW(nonblocking_capture, 0);
+static IIO_DEVICE_ATTR(samples_pushed, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_PUSHED);
+static IIO_DEVICE_ATTR(samples_skipped, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_SKIPPED);
+static IIO_DEVICE_ATTR(samples_timedout, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_TIMEDOUT);
+static IIO_DEVICE_ATTR(bus_retries, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_RETRIES);
+static IIO_DEVICE_ATTR(bus_recoveries, 0444, sps30_counter_show, NULL,
+		       SPS30_CNT_RECOVERIES);
 
 static struct attribute *sps30_attrs[] = {
 	&iio_dev_attr_start_cleaning.dev_attr.attr,
 	&iio_dev_attr_cleaning_period.dev_attr.attr,
 	&iio_dev_attr_cleaning_period_available.dev_attr.attr,
+	&iio_dev_attr_is_cleaning.dev_attr.attr,
+	&iio_dev_attr_idle_cleaning_period.dev_attr.attr,
+	&iio_dev_attr_cleanings.dev_attr.attr,
+	&iio_dev_attr_serial_number.dev_attr.attr,
+	&iio_dev_attr_firmware_version.dev_attr.attr,
+	&iio_dev_attr_device_status.dev_attr.attr,
+	&iio_dev_attr_cache_max_age_ms.dev_attr.attr,
+	&iio_dev_attr_continuous_mode.dev_attr.attr,
+	&iio_dev_attr_history.dev_attr.attr,
+	&iio_dev_attr_snapshot.dev_attr.attr,
+	&iio_dev_attr_sample_seq.dev_attr.attr,
+	&iio_dev_attr_oversampling_mode.dev_attr.attr,
+	&iio_dev_attr_oversampling_mode_available.dev_attr.attr,
+	&iio_dev_attr_oversampling_ratio_available.dev_attr.attr,
+	&iio_dev_attr_frame_prediction_hits.dev_attr.attr,
+	&iio_dev_attr_frame_prediction_misses.dev_attr.attr,
+	&iio_dev_attr_nonblocking_capture.dev_attr.attr,
+	&iio_dev_attr_samples_pushed.dev_attr.attr,
+	&iio_dev_attr_samples_skipped.dev_attr.attr,
+	&iio_dev_attr_samples_timedout.dev_attr.attr,
+	&iio_dev_attr_bus_retries.dev_attr.attr,
+	&iio_dev_attr_bus_recoveries.dev_attr.attr,
 	NULL
 };
 
@@ -525,9 +2447,158 @@ static const struct attribute_group sps30_attr_group = {
 	.attrs = sps30_attrs,
 };
 
+/* bit in ev_enabled and ev_fired */
+static int sps30_event_bit(const struct iio_chan_spec *chan,
+			   enum iio_event_direction dir)
+{
+	return chan->address * 2 + (dir == IIO_EV_DIR_FALLING);
+}
+
+static int sps30_read_event_config(struct iio_dev *indio_dev,
+				   const struct iio_chan_spec *chan,
+				   enum iio_event_type type,
+				   enum iio_event_direction dir)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+
+	return test_bit(sps30_event_bit(chan, dir), &state->ev_enabled);
+}
+
+static int sps30_write_event_config(struct iio_dev *indio_dev,
+				    const struct iio_chan_spec *chan,
+				    enum iio_event_type type,
+				    enum iio_event_direction dir,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+				    int enable)
+#else /* LINUX_VERSION_CODE >= 6.13.0 */
+				    bool enable)
+#endif /* LINUX_VERSION_CODE < 6.13.0 */
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	int ret, bit = sps30_event_bit(chan, dir);
+	bool was, now;
+
+	/* events are evaluated in the background which keeps sensor awake */
+	ret = sps30_pm_get(state);
+	if (ret)
+		return ret;
+
+	spin_lock(&state->frame_lock);
+	was = state->ev_enabled;
+	if (enable)
+		set_bit(bit, &state->ev_enabled);
+	else
+		clear_bit(bit, &state->ev_enabled);
+	clear_bit(bit, &state->ev_fired);
+	now = state->ev_enabled;
+	if (!sps30_sampling(state))
+		WRITE_ONCE(state->sched.kick, false);
+	spin_unlock(&state->frame_lock);
+
+	if (now)
+		schedule_delayed_work(&state->sample_work, 0);
+
+	/* one reference is held for as long as any event is enabled */
+	if (!now || was)
+		sps30_pm_put(state);
+	if (was && !now)
+		sps30_pm_put(state);
+
+	return 0;
+}
+
+static int sps30_read_event_value(struct iio_dev *indio_dev,
+				  const struct iio_chan_spec *chan,
+				  enum iio_event_type type,
+				  enum iio_event_direction dir,
+				  enum iio_event_info info,
+				  int *val, int *val2)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	int d = dir == IIO_EV_DIR_FALLING;
+	s32 tmp;
+
+	switch (info) {
+	case IIO_EV_INFO_VALUE:
+		tmp = state->thresh[chan->address][d];
+		break;
+	case IIO_EV_INFO_HYSTERESIS:
+		tmp = state->hyst[chan->address][d];
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*val = tmp / state->res;
+	*val2 = (tmp % state->res) * (1000000 / state->res);
+
+	return IIO_VAL_INT_PLUS_MICRO;
+}
+
+static int sps30_write_event_value(struct iio_dev *indio_dev,
+				   const struct iio_chan_spec *chan,
+				   enum iio_event_type type,
+				   enum iio_event_direction dir,
+				   enum iio_event_info info,
+				   int val, int val2)
+{
+	struct sps30_state *state = iio_priv(indio_dev);
+	int d = dir == IIO_EV_DIR_FALLING;
+	s32 tmp;
+
+	if (val < 0 || val > SPS30_MAX_PM || val2 < 0)
+		return -EINVAL;
+
+	/* same resolution as measurements */
+	tmp = val * state->res + val2 / (1000000 / state->res);
+
+	spin_lock(&state->frame_lock);
+	switch (info) {
+	case IIO_EV_INFO_VALUE:
+		state->thresh[chan->address][d] = tmp;
+		break;
+	case IIO_EV_INFO_HYSTERESIS:
+		state->hyst[chan->address][d] = tmp;
+		break;
+	default:
+		spin_unlock(&state->frame_lock);
+		return -EINVAL;
+	}
+	clear_bit(sps30_event_bit(chan, dir), &state->ev_fired);
+	spin_unlock(&state->frame_lock);
+
+	return 0;
+}
+
 static const struct iio_info sps30_info = {
 	.attrs = &sps30_attr_group,
 	.read_raw = sps30_read_raw,
+	.write_raw = sps30_write_raw,
+	.read_event_config = sps30_read_event_config,
+	.write_event_config = sps30_write_event_config,
+	.read_event_value = sps30_read_event_value,
+	.write_event_value = sps30_write_event_value,
+#ifdef CONFIG_IIO_BUFFER
+	.hwfifo_set_watermark = sps30_set_watermark,
+	.hwfifo_flush_to_buffer = sps30_flush,
+#endif /* CONFIG_IIO_BUFFER */
+};
+
+static const struct iio_event_spec sps30_events[] = {
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+				 BIT(IIO_EV_INFO_HYSTERESIS) |
+				 BIT(IIO_EV_INFO_ENABLE),
+	},
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_FALLING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+				 BIT(IIO_EV_INFO_HYSTERESIS) |
+				 BIT(IIO_EV_INFO_ENABLE),
+	},
 };
 
 #ifndef SPS30_CHAN
@@ -537,25 +2608,216 @@ static const struct iio_info sps30_info = {
 	.channel2 = IIO_MOD_ ## _mod, \
 	.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED), \
 	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE), \
+	.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO) | \
+				   BIT(IIO_CHAN_INFO_SAMP_FREQ), \
 	.address = _mod, \
+	.event_spec = sps30_events, \
+	.num_event_specs = ARRAY_SIZE(sps30_events), \
 	.scan_index = _index, \
 	.scan_type = { \
 		.sign = 'u', \
-		.realbits = 19, \
+		.realbits = 25, \
 		.storagebits = 32, \
 		.endianness = IIO_CPU, \
 	}, \
 }
 #endif /* SPS30_CHAN */
 
+/* there are no modifiers for number concentrations or particle size */
+#define SPS30_EXT_CHAN(_index, _type, _addr, _name) { \
+	.type = _type, \
+	.extend_name = _name, \
+	.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED), \
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE), \
+	.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO) | \
+				   BIT(IIO_CHAN_INFO_SAMP_FREQ), \
+	.address = _addr, \
+	.scan_index = _index, \
+	.scan_type = { \
+		.sign = 'u', \
+		.realbits = 25, \
+		.storagebits = 32, \
+		.endianness = IIO_CPU, \
+	}, \
+}
+
 static const struct iio_chan_spec sps30_channels[] = {
 	SPS30_CHAN(0, PM1),
 	SPS30_CHAN(1, PM2P5),
 	SPS30_CHAN(2, PM4),
 	SPS30_CHAN(3, PM10),
-	IIO_CHAN_SOFT_TIMESTAMP(4),
+	SPS30_EXT_CHAN(4, IIO_CONCENTRATION, NC0P5, "nc0p5"),
+	SPS30_EXT_CHAN(5, IIO_CONCENTRATION, NC1, "nc1"),
+	SPS30_EXT_CHAN(6, IIO_CONCENTRATION, NC2P5, "nc2p5"),
+	SPS30_EXT_CHAN(7, IIO_CONCENTRATION, NC4, "nc4"),
+	SPS30_EXT_CHAN(8, IIO_CONCENTRATION, NC10, "nc10"),
+	SPS30_EXT_CHAN(9, IIO_DISTANCE, TPS, "typical_particle_size"),
+	IIO_CHAN_SOFT_TIMESTAMP(10),
+};
+
+/* lays out slots of all sensors sharing the bus, called with lists locked */
+static void sps30_bus_update(struct sps30_bus *bus)
+{
+	struct sps30_state *state;
+	unsigned int i = 0;
+
+	list_for_each_entry(state, &bus->devices, bus_node)
+		WRITE_ONCE(state->slot_ns, div_u64(SPS30_MEAS_PERIOD_NS * i++,
+						   bus->count));
+}
+
+static int sps30_bus_join(struct sps30_state *state)
+{
+	const void *root = state->ops->bus_root(state, &state->bus_pos);
+	struct sps30_state *other;
+	struct list_head *pos;
+	struct sps30_bus *bus;
+
+	mutex_lock(&sps30_buses_lock);
+	list_for_each_entry(bus, &sps30_buses, node)
+		if (bus->root == root)
+			goto found;
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		mutex_unlock(&sps30_buses_lock);
+		return -ENOMEM;
+	}
+	bus->root = root;
+	bus->epoch = ktime_get();
+	INIT_LIST_HEAD(&bus->devices);
+	mutex_init(&bus->lock);
+	list_add(&bus->node, &sps30_buses);
+found:
+	/* neighbouring mux channels get neighbouring slots */
+	pos = &bus->devices;
+	list_for_each_entry(other, &bus->devices, bus_node) {
+		if (other->bus_pos > state->bus_pos) {
+			pos = &other->bus_node;
+			break;
+		}
+	}
+	list_add_tail(&state->bus_node, pos);
+	bus->count++;
+	state->bus = bus;
+	sps30_bus_update(bus);
+	mutex_unlock(&sps30_buses_lock);
+
+	return 0;
+}
+
+static void sps30_bus_leave(void *data)
+{
+	struct sps30_state *state = data;
+	struct sps30_bus *bus = state->bus;
+
+	mutex_lock(&sps30_buses_lock);
+	list_del(&state->bus_node);
+	if (--bus->count) {
+		sps30_bus_update(bus);
+	} else {
+		list_del(&bus->node);
+		mutex_destroy(&bus->lock);
+		kfree(bus);
+	}
+	mutex_unlock(&sps30_buses_lock);
+}
+
+static int sps30_stats_show(struct seq_file *s, void *unused)
+{
+	struct sps30_state *state = s->private;
+	struct sps30_stats *stats = &state->stats;
+	u64 ppf;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sps30_cmds); i++)
+		seq_printf(s, "cmd_%s: %llu\n", sps30_cmds[i].name,
+			   stats->cmds[i]);
+	seq_printf(s, "tx_bytes: %llu\n", stats->tx_bytes);
+	seq_printf(s, "rx_bytes: %llu\n", stats->rx_bytes);
+	seq_printf(s, "crc_errors: %llu\n", stats->crc_errors);
+	seq_printf(s, "polls: %llu\n", stats->polls);
+	seq_printf(s, "frames: %llu\n", stats->frames);
+	/* in hundredths, most frames take one poll and some take two */
+	ppf = stats->frames ? div64_u64(stats->polls * 100, stats->frames) : 0;
+	seq_printf(s, "polls_per_frame: %llu.%02llu\n", div_u64(ppf, 100),
+		   ppf - div_u64(ppf, 100) * 100);
+	seq_printf(s, "timeouts: %llu\n", stats->timeouts);
+
+	return 0;
+}
+
+static int sps30_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sps30_stats_show, inode->i_private);
+}
+
+static const struct file_operations sps30_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = sps30_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* one line per bucket, lower bound in microseconds followed by count */
+static int sps30_hist_show(struct seq_file *s, void *unused)
+{
+	u64 *hist = s->private;
+	int i;
+
+	for (i = 0; i < SPS30_HIST_BUCKETS; i++)
+		seq_printf(s, "%u %llu\n", i ? 1U << i : 0, hist[i]);
+
+	return 0;
+}
+
+static int sps30_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sps30_hist_show, inode->i_private);
+}
+
+static const struct file_operations sps30_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = sps30_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
+static void sps30_debugfs_remove(void *data)
+{
+	struct sps30_state *state = data;
+
+	debugfs_remove_recursive(state->debugfs);
+}
+
+static int sps30_debugfs_init(struct sps30_state *state)
+{
+	struct device *dev = state->dev;
+	char name[32];
+
+	snprintf(name, sizeof(name), "sps30-%s", dev_name(dev));
+	/* debugfs is optional, failures are not fatal */
+	state->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("stats", 0444, state->debugfs, state,
+			    &sps30_stats_fops);
+	debugfs_create_file("xfer_latency_us", 0444, state->debugfs,
+			    state->stats.xfer_hist, &sps30_hist_fops);
+	debugfs_create_file("meas_latency_us", 0444, state->debugfs,
+			    state->stats.meas_hist, &sps30_hist_fops);
+
+	return devm_add_action_or_reset(dev, sps30_debugfs_remove, state);
+}
+
+static void sps30_detach(void *data)
+{
+	struct sps30_state *state = data;
+
+	if (state->ops->detach)
+		state->ops->detach(state);
+}
+
 static void sps30_stop_meas(void *data)
 {
 	struct sps30_state *state = data;
@@ -563,91 +2825,332 @@ static void sps30_stop_meas(void *data)
 	sps30_do_cmd(state, SPS30_STOP_MEAS, NULL, 0);
 }
 
-static const unsigned long sps30_scan_masks[] = { 0x0f, 0x00 };
+static void sps30_stop_sampling(void *data)
+{
+	struct sps30_state *state = data;
+	bool continuous, averaging, events;
+
+	spin_lock(&state->frame_lock);
+	continuous = state->continuous;
+	averaging = state->osr > 1;
+	events = state->ev_enabled;
+	state->continuous = false;
+	state->trig_enabled = false;
+	state->osr = 1;
+	state->ev_enabled = 0;
+	WRITE_ONCE(state->sched.kick, false);
+	spin_unlock(&state->frame_lock);
+
+	if (continuous)
+		pm_runtime_put_noidle(state->dev);
+	if (averaging)
+		pm_runtime_put_noidle(state->dev);
+	if (events)
+		pm_runtime_put_noidle(state->dev);
+
+	hrtimer_cancel(&state->sched.timer);
+	cancel_delayed_work_sync(&state->sample_work);
+}
 
-static int sps30_probe(struct i2c_client *client)
+static void sps30_pm_disable(void *data)
 {
-	struct iio_dev *indio_dev;
-	struct sps30_state *state;
+	struct sps30_state *state = data;
+	struct device *dev = state->dev;
+
+	/* leave sensor awake so that it can be stopped and probed again */
+	pm_runtime_get_sync(dev);
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	pm_runtime_put_noidle(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+}
+
+static void sps30_free_ring(void *data)
+{
+	struct sps30_state *state = data;
+
+	kfifo_free(&state->ring);
+}
+
+static int sps30_init(struct sps30_state *state)
+{
+	struct device *dev = state->dev;
 	u8 buf[32];
 	int ret;
 
-	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
-		return -EOPNOTSUPP;
+	ret = sps30_do_cmd_reset(state);
+	if (ret) {
+		dev_err(dev, "failed to reset device\n");
+		return ret;
+	}
+
+	ret = sps30_do_cmd(state, SPS30_READ_SERIAL, state->serial,
+			   sizeof(state->serial));
+	if (ret) {
+		dev_err(dev, "failed to read serial number\n");
+		return ret;
+	}
+	/* returned serial number is already NUL terminated */
+	state->serial[sizeof(state->serial) - 1] = '\0';
+	dev_info(dev, "serial number: %s\n", state->serial);
+
+	/* older firmware does not know this command */
+	if (!sps30_do_cmd(state, SPS30_READ_VERSION, buf, 2)) {
+		state->fw_major = buf[0];
+		state->fw_minor = buf[1];
+		dev_info(dev, "firmware version: %d.%d\n",
+			 state->fw_major, state->fw_minor);
+	}
+
+	if (!sps30_do_cmd(state, SPS30_READ_AUTO_CLEANING_PERIOD, buf, 4)) {
+		state->cleaning_period = get_unaligned_be32(buf);
+		state->cleaning_period_valid = true;
+	}
+
+	if (sps30_has_status(state)) {
+		ret = sps30_do_cmd(state, SPS30_READ_DEVICE_STATUS, buf, 4);
+		if (!ret) {
+			state->status = get_unaligned_be32(buf);
+			state->status_ts = ktime_get();
+		}
+	}
+
+	state->uint16_format = uint16_format &&
+			       state->fw_major >= SPS30_UINT16_MIN_FW_MAJOR;
 
-	indio_dev = devm_iio_device_alloc(&client->dev, sizeof(*state));
+	return 0;
+}
+
+static void sps30_init_work(struct work_struct *work)
+{
+	struct sps30_state *state = container_of(work, struct sps30_state,
+						 init_work);
+
+	mutex_lock(&state->lock);
+	state->init_err = sps30_init(state);
+	mutex_unlock(&state->lock);
+	complete_all(&state->init_done);
+
+	/* sensor is idle now, let it fall asleep unless somebody reads */
+	pm_runtime_mark_last_busy(state->dev);
+	pm_runtime_put_autosuspend(state->dev);
+}
+
+static void sps30_flush_init(void *data)
+{
+	struct sps30_state *state = data;
+
+	flush_work(&state->init_work);
+}
+
+static void sps30_cancel_cleaning(void *data)
+{
+	struct sps30_state *state = data;
+
+	WRITE_ONCE(state->idle_cleaning_period, 0);
+	cancel_delayed_work_sync(&state->clean_work);
+}
+
+int sps30_probe(struct device *dev, const char *name, void *priv,
+		const struct sps30_ops *ops)
+{
+	struct iio_dev *indio_dev;
+	struct sps30_state *state;
+	int i, ret;
+
+	indio_dev = devm_iio_device_alloc(dev, sizeof(*state));
 	if (!indio_dev)
 		return -ENOMEM;
 
 	state = iio_priv(indio_dev);
-	i2c_set_clientdata(client, indio_dev);
-	state->client = client;
+	dev_set_drvdata(dev, state);
+	state->dev = dev;
+	state->indio_dev = indio_dev;
+	state->ops = ops;
+	state->priv = priv;
+	/* runs last on removal, right before the state goes away */
+	ret = devm_add_action_or_reset(dev, sps30_detach, state);
+	if (ret)
+		return ret;
+
 	state->state = RESET;
-	indio_dev->dev.parent = &client->dev;
+	state->cache_max_age_ms = SPS30_MEAS_PERIOD_MS;
+	state->osr = 1;
+	state->watermark = 1;
+	state->decimals = clamp_t(int, decimals, SPS30_DECIMALS_MIN,
+				  SPS30_DECIMALS_MAX);
+	for (i = 0, state->res = 1; i < state->decimals; i++)
+		state->res *= 10;
+	crc8_populate_msb(sps30_crc8_table, SPS30_CRC8_POLYNOMIAL);
+	indio_dev->dev.parent = dev;
 	indio_dev->info = &sps30_info;
-	indio_dev->name = client->name;
+	indio_dev->name = name;
 	indio_dev->channels = sps30_channels;
 	indio_dev->num_channels = ARRAY_SIZE(sps30_channels);
 	indio_dev->modes = INDIO_DIRECT_MODE;
-	indio_dev->available_scan_masks = sps30_scan_masks;
 
 	mutex_init(&state->lock);
-	crc8_populate_msb(sps30_crc8_table, SPS30_CRC8_POLYNOMIAL);
+	mutex_init(&state->push_lock);
+	INIT_WORK(&state->init_work, sps30_init_work);
+	init_completion(&state->init_done);
+	spin_lock_init(&state->frame_lock);
+	init_waitqueue_head(&state->frame_wq);
+	INIT_DELAYED_WORK(&state->sample_work, sps30_sample_work);
+	INIT_DELAYED_WORK(&state->clean_work, sps30_clean_work);
+	state->cleaned_ts = ktime_get();
+	hrtimer_init(&state->sched.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	state->sched.timer.function = sps30_sched_timer;
+	init_waitqueue_head(&state->sched.wq);
+	state->sched.period_ns = SPS30_MEAS_PERIOD_NS;
+
+	ret = kfifo_alloc(&state->ring, max(ring_depth, 2U), GFP_KERNEL);
+	if (ret)
+		return ret;
 
-	ret = sps30_do_cmd_reset(state);
-	if (ret) {
-		dev_err(&client->dev, "failed to reset device\n");
+	ret = devm_add_action_or_reset(dev, sps30_free_ring, state);
+	if (ret)
 		return ret;
-	}
 
-	ret = sps30_do_cmd(state, SPS30_READ_SERIAL, buf, sizeof(buf));
-	if (ret) {
-		dev_err(&client->dev, "failed to read serial number\n");
+	ret = sps30_debugfs_init(state);
+	if (ret)
 		return ret;
+
+	if (bus_sched && ops->bus_root) {
+		ret = sps30_bus_join(state);
+		if (ret)
+			return ret;
+
+		ret = devm_add_action_or_reset(dev, sps30_bus_leave,
+					       state);
+		if (ret)
+			return ret;
 	}
-	/* returned serial number is already NUL terminated */
-	dev_info(&client->dev, "serial number: %s\n", buf);
 
-	ret = devm_add_action_or_reset(&client->dev, sps30_stop_meas, state);
+	ret = devm_add_action_or_reset(dev, sps30_stop_meas, state);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action_or_reset(dev, sps30_stop_sampling,
+				       state);
+	if (ret)
+		return ret;
+
+	/* reference is dropped once sensor initialization is done */
+	pm_runtime_get_noresume(dev);
+	pm_runtime_set_active(dev);
+	pm_runtime_enable(dev);
+	ret = devm_add_action_or_reset(dev, sps30_pm_disable, state);
+	if (ret)
+		return ret;
+
+	pm_runtime_set_autosuspend_delay(dev,
+					 SPS30_AUTOSUSPEND_DELAY_MS);
+	pm_runtime_use_autosuspend(dev);
+
+	/* reset takes a while, do not hold up the boot waiting for it */
+	schedule_work(&state->init_work);
+	ret = devm_add_action_or_reset(dev, sps30_flush_init, state);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action_or_reset(dev, sps30_cancel_cleaning,
+				       state);
 	if (ret)
 		return ret;
 
 #ifdef CONFIG_IIO_BUFFER
-	ret = devm_iio_triggered_buffer_setup(&client->dev, indio_dev, NULL,
-					      sps30_trigger_handler, NULL);
+	state->batch = devm_kcalloc(dev, kfifo_size(&state->ring),
+				    sizeof(*state->batch), GFP_KERNEL);
+	if (!state->batch)
+		return -ENOMEM;
+
+	state->trig = devm_iio_trigger_alloc(dev, "%s-dev%d",
+					     indio_dev->name, indio_dev->id);
+	if (!state->trig)
+		return -ENOMEM;
+
+	state->trig->dev.parent = dev;
+	state->trig->ops = &sps30_trigger_ops;
+	iio_trigger_set_drvdata(state->trig, indio_dev);
+
+	ret = devm_iio_trigger_register(dev, state->trig);
+	if (ret)
+		return ret;
+
+	/* sensor paced trigger is the natural choice, use it by default */
+	indio_dev->trig = iio_trigger_get(state->trig);
+
+	ret = devm_iio_triggered_buffer_setup(dev, indio_dev, NULL,
+					      sps30_trigger_handler,
+					      &sps30_buffer_ops);
 	if (ret)
 		return ret;
 #endif /* CONFIG_IIO_BUFFER */
 
-	return devm_iio_device_register(&client->dev, indio_dev);
+	return devm_iio_device_register(dev, indio_dev);
 }
+EXPORT_SYMBOL_GPL(sps30_probe);
 
-static const struct i2c_device_id sps30_id[] = {
-	{ "sps30" },
-	{ }
-};
-MODULE_DEVICE_TABLE(i2c, sps30_id);
+static int __maybe_unused sps30_runtime_suspend(struct device *dev)
+{
+	struct sps30_state *state = dev_get_drvdata(dev);
+	int ret;
 
-static const struct of_device_id sps30_of_match[] = {
-	{ .compatible = "sensirion,sps30" },
-	{ }
-};
-MODULE_DEVICE_TABLE(of, sps30_of_match);
+	/* let the fan finish cleaning, autosuspend is retried afterwards */
+	if (sps30_cleaning(state)) {
+		pm_runtime_mark_last_busy(dev);
+		return -EBUSY;
+	}
 
-static struct i2c_driver sps30_driver = {
-	.driver = {
-		.name = "sps30",
-		.of_match_table = sps30_of_match,
-	},
-	.id_table = sps30_id,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 21, 0)
-	.probe = sps30_probe_old,
-#else
-	.probe_new = sps30_probe,
-#endif /* LINUX_VERSION_CODE */
+	mutex_lock(&state->lock);
+	ret = sps30_do_cmd(state, SPS30_STOP_MEAS, NULL, 0);
+	if (ret)
+		goto out;
+
+	state->state = RESET;
+	/* older firmware can only stop measuring */
+	if (state->fw_major >= SPS30_SLEEP_MIN_FW_MAJOR) {
+		ret = sps30_do_cmd(state, SPS30_SLEEP, NULL, 0);
+		if (!ret)
+			state->asleep = true;
+	}
+out:
+	mutex_unlock(&state->lock);
+	if (!ret)
+		return 0;
+
+	/* other errors would disable runtime pm, stay up and retry later */
+	dev_warn(dev, "failed to suspend sensor: %d\n", ret);
+	pm_runtime_mark_last_busy(dev);
+
+	return -EAGAIN;
+}
+
+static int __maybe_unused sps30_runtime_resume(struct device *dev)
+{
+	struct sps30_state *state = dev_get_drvdata(dev);
+	int ret;
+
+	mutex_lock(&state->lock);
+	ret = sps30_wakeup(state);
+	mutex_unlock(&state->lock);
+	/*
+	 * Errors would disable runtime pm for good. Sensor is still asleep and
+	 * in reset, so starting measurement tries again and failures end up
+	 * in recovery.
+	 */
+	if (ret)
+		dev_warn(dev, "failed to wake up sensor: %d\n", ret);
+
+	/* measurement is started on demand */
+	return 0;
+}
+
+const struct dev_pm_ops sps30_pm_ops = {
+	SET_RUNTIME_PM_OPS(sps30_runtime_suspend, sps30_runtime_resume, NULL)
 };
-module_i2c_driver(sps30_driver);
+EXPORT_SYMBOL_GPL(sps30_pm_ops);
 
 MODULE_AUTHOR("Tomasz Duszynski <tduszyns@gmail.com>");
-MODULE_DESCRIPTION("Sensirion SPS30 particulate matter sensor driver");
+MODULE_DESCRIPTION("Sensirion SPS30 particulate matter sensor core driver");
 MODULE_LICENSE("GPL v2");
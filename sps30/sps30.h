@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SPS30_H
+#define _SPS30_H
+
+#include <linux/crc8.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+struct device;
+struct sps30_state;
+
+/* max number of payload bytes, measurements or serial string */
+#define SPS30_MAX_READ_SIZE 40
+/* same on i2c, where every two bytes of payload are followed by crc8 */
+#define SPS30_MAX_RAW_SIZE (SPS30_MAX_READ_SIZE + SPS30_MAX_READ_SIZE / 2)
+#define SPS30_CRC8_POLYNOMIAL 0x31
+/* sensor measures reliably up to 3000 ug / m3 */
+#define SPS30_MAX_PM 3000
+/* typical particle size always comes in hundredths of micrometer */
+#define SPS30_TPS_RES 100
+
+/* measurements in the order they come off the sensor */
+enum {
+	PM1,
+	PM2P5,
+	PM4,
+	PM10,
+	NC0P5,
+	NC1,
+	NC2P5,
+	NC4,
+	NC10,
+	TPS,
+};
+
+/*
+ * SPS30 commands. Numbered after their i2c addresses, other transports
+ * translate them.
+ */
+#define SPS30_START_MEAS 0x0010
+#define SPS30_STOP_MEAS 0x0104
+#define SPS30_RESET 0xd304
+#define SPS30_READ_DATA_READY_FLAG 0x0202
+#define SPS30_READ_DATA 0x0300
+#define SPS30_READ_SERIAL 0xd033
+#define SPS30_READ_VERSION 0xd100
+#define SPS30_START_FAN_CLEANING 0x5607
+#define SPS30_AUTO_CLEANING_PERIOD 0x8004
+/* not a sensor command per se, used only to distinguish write from read */
+#define SPS30_READ_AUTO_CLEANING_PERIOD 0x8005
+#define SPS30_SLEEP 0x1001
+#define SPS30_WAKEUP 0x1103
+#define SPS30_READ_DEVICE_STATUS 0xd206
+
+struct sps30_ops {
+	/*
+	 * Executes a single command. Arguments of writes and replies of reads
+	 * are passed as size bytes of payload in data, without any framing or
+	 * checksums. Returns -EBADMSG if a reply fails the integrity check.
+	 */
+	int (*do_cmd)(struct sps30_state *state, u16 cmd, u8 *data, int size);
+	/*
+	 * Replies to READ_DATA are handed over as they came off the wire,
+	 * every data word followed by its crc8, size still counting payload
+	 * bytes only. Core then verifies checksums while converting.
+	 */
+	bool raw_meas;
+	/*
+	 * Optional, returns the medium shared with other sensors along with
+	 * the position of this sensor on it. Used for bus scheduling.
+	 */
+	const void *(*bus_root)(struct sps30_state *state, int *pos);
+	/*
+	 * Optional, called on removal once the core is done talking to the
+	 * sensor and before its state is freed. Nothing may reach the core
+	 * from the transport afterwards.
+	 */
+	void (*detach)(struct sps30_state *state);
+};
+
+int sps30_probe(struct device *dev, const char *name, void *priv,
+		const struct sps30_ops *ops);
+void *sps30_get_priv(struct sps30_state *state);
+/* accounts for a single exchange with the sensor started at start */
+void sps30_xfer_done(struct sps30_state *state, ktime_t start, int txsize,
+		     int rxsize, int ret);
+
+extern const struct dev_pm_ops sps30_pm_ops;
+extern u8 sps30_crc8_table[CRC8_TABLE_SIZE];
+
+/* crc8 of a single data word, same as crc8() but without a loop */
+static inline u8 sps30_crc_word(const u8 *buf)
+{
+	return sps30_crc8_table[sps30_crc8_table[CRC8_INIT_VALUE ^ buf[0]] ^
+				buf[1]];
+}
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* conversions of raw measurements, exported for sps30_kunit only */
+s32 sps30_float_to_int_clamped(const u8 *fp, u32 res);
+s32 sps30_uint16_to_int_clamped(const u8 *buf, int index, u32 res);
+int sps30_decode(const u8 *raw, s32 *meas, int size, bool uint16_format,
+		 bool crc, u32 res);
+#endif /* CONFIG_KUNIT */
+
+#endif /* _SPS30_H */
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sensirion SPS30 particulate matter sensor emulator
+ *
+ * I2C slave backend answering like a sensor, so that the driver can be
+ * exercised and measured on boards without one. Needs an adapter with
+ * slave support wired to, or looped back onto, the one the driver sits on.
+ *
+ * I2C slave address: 0x69
+ */
+
+#include <asm/unaligned.h>
+#include <linux/bitops.h>
+#include <linux/crc8.h>
+#include <linux/i2c.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mod_devicetable.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "sps30.h"
+
+/* Sensirion compatibility code for older Kernel versions */
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 21, 0)
+static int sps30_emu_probe(struct i2c_client *client);
+static int sps30_emu_probe_old(struct i2c_client *client,
+			       const struct i2c_device_id *id)
+{
+    return sps30_emu_probe(client);
+}
+#endif /* LINUX_VERSION_CODE < 4.21.0 */
+
+#define SPS30_EMU_CRC8_POLYNOMIAL 0x31
+#define SPS30_EMU_FORMAT_UINT16 0x05
+/* command word followed by up to two checksummed argument words */
+#define SPS30_EMU_MAX_REQUEST_SIZE 8
+#define SPS30_EMU_MAX_REPLY_SIZE (SPS30_MAX_READ_SIZE + SPS30_MAX_READ_SIZE / 2)
+#define SPS30_EMU_NUM_MEAS 10
+
+static unsigned int frame_period_ms = 1000;
+module_param(frame_period_ms, uint, 0644);
+MODULE_PARM_DESC(frame_period_ms,
+		 "Time between two frames in milliseconds (default: 1000)");
+
+static unsigned int crc_error_interval;
+module_param(crc_error_interval, uint, 0644);
+MODULE_PARM_DESC(crc_error_interval,
+		 "Corrupt checksum of every n-th reply (default: 0, never)");
+
+static char *serial = "SPS30EMU00000000";
+module_param(serial, charp, 0444);
+MODULE_PARM_DESC(serial, "Serial number reported (default: SPS30EMU00000000)");
+
+struct sps30_emu {
+	struct i2c_client *client;
+	u8 rx[SPS30_EMU_MAX_REQUEST_SIZE];
+	int rx_len;
+	/* reply prepared by the latest request, returned by following reads */
+	u8 tx[SPS30_EMU_MAX_REPLY_SIZE];
+	int tx_len;
+	int tx_pos;
+	unsigned int replies;
+	bool measuring;
+	u8 format;
+	ktime_t started;
+	/* last frame read, counted in frame periods since start */
+	s64 consumed;
+	u32 cleaning_period;
+};
+
+DECLARE_CRC8_TABLE(sps30_emu_crc8_table);
+
+/* appends a data word along with its checksum */
+static void sps30_emu_put_word(struct sps30_emu *emu, u16 word)
+{
+	u8 *p = &emu->tx[emu->tx_len];
+
+	if (emu->tx_len + 3 > sizeof(emu->tx))
+		return;
+
+	put_unaligned_be16(word, p);
+	p[2] = crc8(sps30_emu_crc8_table, p, 2, CRC8_INIT_VALUE);
+	emu->tx_len += 3;
+}
+
+/* IEEE 754 single precision representation of a hundredth of val */
+static u32 sps30_emu_to_float(u32 val)
+{
+	int exp, shift;
+	u64 mant;
+
+	if (!val)
+		return 0;
+
+	/* scale up so that dividing by 100 keeps all 24 bits of mantissa */
+	mant = div_u64((u64)val << 32, 100);
+	exp = fls64(mant) - 1;
+	shift = exp - 23;
+	mant = shift > 0 ? mant >> shift : mant << -shift;
+
+	return (exp - 32 + 127) << 23 | (mant & GENMASK(22, 0));
+}
+
+/*
+ * Frame contents follow a slow sawtooth so that consumers see changing
+ * values. Mass and number concentrations are in hundredths of their unit,
+ * typical particle size in nanometers.
+ */
+static void sps30_emu_put_frame(struct sps30_emu *emu, s64 frame)
+{
+	u32 base = 500 + (frame % 64) * 25, val, fp;
+	int i;
+
+	for (i = 0; i < SPS30_EMU_NUM_MEAS; i++) {
+		if (i == SPS30_EMU_NUM_MEAS - 1)
+			val = 450 + (frame % 8) * 10;
+		else if (i < 4)
+			val = base + i * 100;
+		else
+			val = base * (9 - i);
+
+		if (emu->format == SPS30_EMU_FORMAT_UINT16) {
+			/* integer format has no fraction, size is in nm */
+			sps30_emu_put_word(emu, i == SPS30_EMU_NUM_MEAS - 1 ?
+					   val : val / 100);
+			continue;
+		}
+
+		/* float format reports typical particle size in um */
+		fp = sps30_emu_to_float(i == SPS30_EMU_NUM_MEAS - 1 ?
+					val / 10 : val);
+		sps30_emu_put_word(emu, fp >> 16);
+		sps30_emu_put_word(emu, fp);
+	}
+}
+
+static s64 sps30_emu_frame(struct sps30_emu *emu)
+{
+	s64 ms = ktime_ms_delta(ktime_get(), emu->started);
+
+	return div_s64(ms, max(READ_ONCE(frame_period_ms), 1U));
+}
+
+static void sps30_emu_handle(struct sps30_emu *emu)
+{
+	u16 cmd = get_unaligned_be16(emu->rx);
+	int i, len = strlen(serial);
+	unsigned int interval;
+	u8 hi, lo;
+	s64 frame;
+
+	emu->tx_len = 0;
+	emu->tx_pos = 0;
+
+	switch (cmd) {
+	case SPS30_START_MEAS:
+		emu->measuring = true;
+		emu->format = emu->rx_len > 2 ? emu->rx[2] : 0;
+		emu->started = ktime_get();
+		emu->consumed = 0;
+		return;
+	case SPS30_STOP_MEAS:
+	case SPS30_RESET:
+	case SPS30_SLEEP:
+		emu->measuring = false;
+		return;
+	case SPS30_READ_DATA_READY_FLAG:
+		frame = emu->measuring ? sps30_emu_frame(emu) : 0;
+		sps30_emu_put_word(emu, frame > emu->consumed);
+		break;
+	case SPS30_READ_DATA:
+		frame = emu->measuring ? sps30_emu_frame(emu) : 0;
+		emu->consumed = frame;
+		sps30_emu_put_frame(emu, frame);
+		break;
+	case SPS30_READ_SERIAL:
+		/* NUL terminated, padded to whole words */
+		for (i = 0; i < 32; i += 2) {
+			hi = i < len ? serial[i] : 0;
+			lo = i + 1 < len ? serial[i + 1] : 0;
+			sps30_emu_put_word(emu, hi << 8 | lo);
+		}
+		break;
+	case SPS30_READ_VERSION:
+		/* firmware 2.2 supports every feature of the driver */
+		sps30_emu_put_word(emu, 0x0202);
+		break;
+	case SPS30_READ_DEVICE_STATUS:
+		sps30_emu_put_word(emu, 0);
+		sps30_emu_put_word(emu, 0);
+		break;
+	case SPS30_AUTO_CLEANING_PERIOD:
+		if (emu->rx_len == SPS30_EMU_MAX_REQUEST_SIZE) {
+			emu->cleaning_period = emu->rx[2] << 24 |
+					       emu->rx[3] << 16 |
+					       emu->rx[5] << 8 | emu->rx[6];
+			return;
+		}
+
+		sps30_emu_put_word(emu, emu->cleaning_period >> 16);
+		sps30_emu_put_word(emu, emu->cleaning_period);
+		break;
+	default:
+		/* fan cleaning and wakeup need no emulation */
+		return;
+	}
+
+	interval = READ_ONCE(crc_error_interval);
+	if (interval && !(++emu->replies % interval))
+		emu->tx[emu->tx_len - 1] ^= 0xff;
+}
+
+static int sps30_emu_slave_cb(struct i2c_client *client,
+			      enum i2c_slave_event event, u8 *val)
+{
+	struct sps30_emu *emu = i2c_get_clientdata(client);
+
+	switch (event) {
+	case I2C_SLAVE_WRITE_REQUESTED:
+		emu->rx_len = 0;
+		break;
+	case I2C_SLAVE_WRITE_RECEIVED:
+		if (emu->rx_len < sizeof(emu->rx))
+			emu->rx[emu->rx_len++] = *val;
+		break;
+	case I2C_SLAVE_READ_PROCESSED:
+		/* previous byte made it to the bus, get the next one */
+		emu->tx_pos++;
+		/* fall through */
+	case I2C_SLAVE_READ_REQUESTED:
+		*val = emu->tx_pos < emu->tx_len ? emu->tx[emu->tx_pos] : 0xff;
+		break;
+	case I2C_SLAVE_STOP:
+		if (emu->rx_len >= 2)
+			sps30_emu_handle(emu);
+		emu->rx_len = 0;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int sps30_emu_probe(struct i2c_client *client)
+{
+	struct sps30_emu *emu;
+
+	emu = devm_kzalloc(&client->dev, sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return -ENOMEM;
+
+	emu->client = client;
+	crc8_populate_msb(sps30_emu_crc8_table, SPS30_EMU_CRC8_POLYNOMIAL);
+	i2c_set_clientdata(client, emu);
+
+	return i2c_slave_register(client, sps30_emu_slave_cb);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+static int sps30_emu_remove(struct i2c_client *client)
+{
+	i2c_slave_unregister(client);
+
+	return 0;
+}
+#else
+static void sps30_emu_remove(struct i2c_client *client)
+{
+	i2c_slave_unregister(client);
+}
+#endif /* LINUX_VERSION_CODE < 6.1.0 */
+
+static const struct i2c_device_id sps30_emu_id[] = {
+	{ "slave-sps30" },
+	{ }
+};
+MODULE_DEVICE_TABLE(i2c, sps30_emu_id);
+
+static struct i2c_driver sps30_emu_driver = {
+	.driver = {
+		.name = "i2c-slave-sps30",
+	},
+	.id_table = sps30_emu_id,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 21, 0)
+	.probe = sps30_emu_probe_old,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	.probe_new = sps30_emu_probe,
+#else
+	.probe = sps30_emu_probe,
+#endif /* LINUX_VERSION_CODE */
+	.remove = sps30_emu_remove,
+};
+module_i2c_driver(sps30_emu_driver);
+
+MODULE_DESCRIPTION("Sensirion SPS30 particulate matter sensor emulator");
+MODULE_LICENSE("GPL v2");
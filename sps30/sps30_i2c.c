@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sensirion SPS30 particulate matter sensor i2c driver
+ *
+ * Copyright (c) Tomasz Duszynski <tduszyns@gmail.com>
+ *
+ * I2C slave address: 0x69
+ */
+
+#include <asm/unaligned.h>
+#include <linux/cache.h>
+#include <linux/crc8.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mod_devicetable.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "sps30.h"
+
+/* Sensirion compatibility code for older Kernel versions */
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 21, 0)
+static int sps30_i2c_probe(struct i2c_client *client);
+static int sps30_i2c_probe_old(struct i2c_client *client,
+			       const struct i2c_device_id *id)
+{
+    return sps30_i2c_probe(client);
+}
+#endif /* LINUX_VERSION_CODE < 4.21.0 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+/* no way to tell the core, buffers are DMA safe nonetheless */
+#define I2C_M_DMA_SAFE 0
+#define i2c_master_send_dmasafe i2c_master_send
+#define i2c_master_recv_dmasafe i2c_master_recv
+#endif /* LINUX_VERSION_CODE < 4.16.0 */
+
+struct sps30_i2c_priv {
+	struct i2c_client *client;
+	/* adapter can put a stop in between messages of a single transfer */
+	bool mangling;
+	/*
+	 * Requests and replies, serialized by the core. Kept off the stack
+	 * and on a cacheline of its own so that adapters can DMA right into
+	 * it.
+	 */
+	u8 buf[SPS30_MAX_RAW_SIZE] ____cacheline_aligned;
+};
+
+static int sps30_i2c_write_then_read(struct sps30_state *state, u8 *txbuf,
+				     int txsize, u8 *rxbuf, int rxsize)
+{
+	struct sps30_i2c_priv *priv = sps30_get_priv(state);
+	struct i2c_client *client = priv->client;
+	struct i2c_msg msgs[] = {
+		{
+			.addr = client->addr,
+			.flags = I2C_M_STOP | I2C_M_DMA_SAFE,
+			.len = txsize,
+			.buf = txbuf,
+		},
+		{
+			.addr = client->addr,
+			.flags = I2C_M_RD | I2C_M_DMA_SAFE,
+			.len = rxsize,
+			.buf = rxbuf,
+		},
+	};
+	ktime_t start = ktime_get();
+	int ret;
+
+	if (!rxbuf)
+		rxsize = 0;
+
+	/*
+	 * Sensor does not support repeated start. If adapter can be told to
+	 * issue a stop in between, send both messages in a single transfer
+	 * so that nobody gets in between.
+	 */
+	if (rxbuf && priv->mangling) {
+		ret = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+		if (ret != ARRAY_SIZE(msgs)) {
+			ret = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	/* otherwise send one by one */
+	ret = i2c_master_send_dmasafe(client, txbuf, txsize);
+	if (ret != txsize) {
+		ret = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+
+	ret = 0;
+	if (!rxbuf)
+		goto out;
+
+	ret = i2c_master_recv_dmasafe(client, rxbuf, rxsize);
+	if (ret != rxsize) {
+		ret = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+	ret = 0;
+out:
+	sps30_xfer_done(state, start, txsize, rxsize, ret);
+
+	return ret;
+}
+
+static int sps30_i2c_do_cmd(struct sps30_state *state, u16 cmd, u8 *data,
+			    int size)
+{
+	/*
+	 * Internally sensor stores measurements in a following manner:
+	 *
+	 * PM1: upper two bytes, crc8, lower two bytes, crc8
+	 * PM2P5: upper two bytes, crc8, lower two bytes, crc8
+	 * PM4: upper two bytes, crc8, lower two bytes, crc8
+	 * PM10: upper two bytes, crc8, lower two bytes, crc8
+	 *
+	 * What follows next are number concentration measurements for
+	 * NC0P5, NC1, NC2P5, NC4, NC10 and typical particle size measurement
+	 * laid out in the same manner.
+	 *
+	 * In integer output format each measurement is just two bytes
+	 * followed by crc8.
+	 */
+	struct sps30_i2c_priv *priv = sps30_get_priv(state);
+	u8 *buf = priv->buf;
+	int i, ret = 0;
+
+	buf[0] = cmd >> 8;
+	buf[1] = cmd;
+	switch (cmd) {
+	case SPS30_START_MEAS:
+		/* output format, the only argument, is padded to a word */
+		buf[2] = data[0];
+		buf[3] = 0x00;
+		buf[4] = crc8(sps30_crc8_table, &buf[2], 2,
+			      CRC8_INIT_VALUE);
+		return sps30_i2c_write_then_read(state, buf, 5, NULL, 0);
+	case SPS30_STOP_MEAS:
+	case SPS30_RESET:
+	case SPS30_START_FAN_CLEANING:
+	case SPS30_SLEEP:
+	case SPS30_WAKEUP:
+		return sps30_i2c_write_then_read(state, buf, 2, NULL, 0);
+	case SPS30_AUTO_CLEANING_PERIOD:
+		buf[2] = data[0];
+		buf[3] = data[1];
+		buf[4] = crc8(sps30_crc8_table, &buf[2], 2,
+			      CRC8_INIT_VALUE);
+		buf[5] = data[2];
+		buf[6] = data[3];
+		buf[7] = crc8(sps30_crc8_table, &buf[5], 2,
+			      CRC8_INIT_VALUE);
+		return sps30_i2c_write_then_read(state, buf, 8, NULL, 0);
+	case SPS30_READ_AUTO_CLEANING_PERIOD:
+		buf[0] = SPS30_AUTO_CLEANING_PERIOD >> 8;
+		buf[1] = (u8)(SPS30_AUTO_CLEANING_PERIOD & 0xff);
+		/* fall through */
+	case SPS30_READ_DATA:
+		/* checksums are verified by the core while converting */
+		size += size / 2;
+		ret = sps30_i2c_write_then_read(state, buf, 2, buf, size);
+		if (!ret)
+			memcpy(data, buf, size);
+
+		return ret;
+	case SPS30_READ_DATA_READY_FLAG:
+	case SPS30_READ_SERIAL:
+	case SPS30_READ_VERSION:
+	case SPS30_READ_DEVICE_STATUS:
+		/* every two data bytes are checksummed */
+		size += size / 2;
+		ret = sps30_i2c_write_then_read(state, buf, 2, buf, size);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (ret)
+		return ret;
+
+	/* validate received data and strip off crc bytes */
+	for (i = 0; i < size; i += 3) {
+		if (sps30_crc_word(&buf[i]) != buf[i + 2])
+			return -EBADMSG;
+
+		*data++ = buf[i];
+		*data++ = buf[i + 1];
+	}
+
+	return 0;
+}
+
+static struct i2c_adapter *sps30_i2c_root_adapter(struct i2c_adapter *adap)
+{
+	struct i2c_adapter *parent;
+
+	while ((parent = i2c_parent_is_i2c_adapter(adap)))
+		adap = parent;
+
+	return adap;
+}
+
+/* sensors behind the same root adapter share it, ordered by mux channel */
+static const void *sps30_i2c_bus_root(struct sps30_state *state, int *pos)
+{
+	struct sps30_i2c_priv *priv = sps30_get_priv(state);
+
+	*pos = priv->client->adapter->nr;
+
+	return sps30_i2c_root_adapter(priv->client->adapter);
+}
+
+static const struct sps30_ops sps30_i2c_ops = {
+	.do_cmd = sps30_i2c_do_cmd,
+	.raw_meas = true,
+	.bus_root = sps30_i2c_bus_root,
+};
+
+static int sps30_i2c_probe(struct i2c_client *client)
+{
+	struct sps30_i2c_priv *priv;
+
+	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
+		return -EOPNOTSUPP;
+
+	priv = devm_kzalloc(&client->dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	priv->client = client;
+	priv->mangling = i2c_check_functionality(client->adapter,
+						 I2C_FUNC_PROTOCOL_MANGLING);
+	return sps30_probe(&client->dev, client->name, priv, &sps30_i2c_ops);
+}
+
+static const struct i2c_device_id sps30_i2c_id[] = {
+	{ "sps30" },
+	{ }
+};
+MODULE_DEVICE_TABLE(i2c, sps30_i2c_id);
+
+static const struct of_device_id sps30_i2c_of_match[] = {
+	{ .compatible = "sensirion,sps30" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, sps30_i2c_of_match);
+
+static struct i2c_driver sps30_i2c_driver = {
+	.driver = {
+		.name = "sps30",
+		.of_match_table = sps30_i2c_of_match,
+		.pm = &sps30_pm_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif /* LINUX_VERSION_CODE >= 4.2.0 */
+	},
+	.id_table = sps30_i2c_id,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 21, 0)
+	.probe = sps30_i2c_probe_old,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	.probe_new = sps30_i2c_probe,
+#else
+	.probe = sps30_i2c_probe,
+#endif /* LINUX_VERSION_CODE */
+};
+module_i2c_driver(sps30_i2c_driver);
+
+MODULE_AUTHOR("Tomasz Duszynski <tduszyns@gmail.com>");
+MODULE_DESCRIPTION("Sensirion SPS30 particulate matter sensor i2c driver");
+MODULE_LICENSE("GPL v2");
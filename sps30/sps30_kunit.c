@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the Sensirion SPS30 particulate matter sensor driver
+ */
+
+#include <asm/unaligned.h>
+#include <kunit/test.h>
+#include <linux/bitops.h>
+#include <linux/crc8.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+
+#include "sps30.h"
+
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW KUNIT_CASE
+#endif /* KUNIT_CASE_SLOW */
+
+/* smallest exponent a 1 / 10000 resolution tells apart from 0 */
+#define SPS30_TEST_EXP_MIN -14
+#define SPS30_TEST_FLOAT_4096 0x45800000
+
+static const u32 sps30_test_res[] = { 100, 1000, 10000 };
+
+/* floats along with what they convert to at 2, 3 and 4 decimals */
+static const struct {
+	u32 val;
+	s32 expected[ARRAY_SIZE(sps30_test_res)];
+} sps30_test_floats[] = {
+	/* zero and denormals */
+	{ 0x00000000, { 0, 0, 0 } },
+	{ 0x00000001, { 0, 0, 0 } },
+	{ 0x007fffff, { 0, 0, 0 } },
+	/* smallest normal */
+	{ 0x00800000, { 0, 0, 0 } },
+	/* 0.5 and 1 */
+	{ 0x3f000000, { 50, 500, 5000 } },
+	{ 0x3f800000, { 100, 1000, 10000 } },
+	/* closest floats around 0.0001, conversion rounds down */
+	{ 0x38d1b717, { 0, 0, 0 } },
+	{ 0x38d1b718, { 0, 0, 1 } },
+	/* 2999.99 comes out as 2999.98999 */
+	{ 0x453b7fd7, { 299998, 2999989, 29999899 } },
+	/* 3000, the largest reported value */
+	{ 0x453b8000, { 300000, 3000000, 30000000 } },
+	/* just below 4096, 4096 and above get clamped */
+	{ 0x457fffff, { 300000, 3000000, 30000000 } },
+	{ 0x45800000, { 300000, 3000000, 30000000 } },
+	{ 0x7f7fffff, { 300000, 3000000, 30000000 } },
+	/* infinity and NaN */
+	{ 0x7f800000, { 300000, 3000000, 30000000 } },
+	{ 0x7fc00000, { 300000, 3000000, 30000000 } },
+};
+
+static s32 sps30_test_float(u32 val, u32 res)
+{
+	u8 fp[4];
+
+	put_unaligned_be32(val, fp);
+
+	return sps30_float_to_int_clamped(fp, res);
+}
+
+/*
+ * Reference conversion done the long way: integer part first, followed by
+ * one decimal digit at a time, which truncates exactly like the driver
+ * is supposed to.
+ */
+static s32 sps30_test_float_ref(u32 val, u32 res)
+{
+	u64 mantissa = BIT(23) | (val & GENMASK(22, 0));
+	int exp = (int)(val >> 23) - 127, shift = 23 - exp;
+	u64 ipart, frac, mask;
+	u32 digits = 0, r;
+
+	if (exp < -126)
+		return 0;
+	if (exp >= 12)
+		return SPS30_MAX_PM * res;
+	/* below 2 ^ -17, far from any resolution and out of digits' reach */
+	if (shift > 40)
+		return 0;
+
+	mask = GENMASK_ULL(shift - 1, 0);
+	ipart = mantissa >> shift;
+	frac = mantissa & mask;
+	for (r = res; r > 1; r /= 10) {
+		frac *= 10;
+		digits = digits * 10 + (frac >> shift);
+		frac &= mask;
+	}
+
+	if (ipart >= SPS30_MAX_PM)
+		return SPS30_MAX_PM * res;
+
+	return ipart * res + digits;
+}
+
+static void sps30_test_float_edges(struct kunit *test)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(sps30_test_floats); i++) {
+		for (j = 0; j < ARRAY_SIZE(sps30_test_res); j++)
+			KUNIT_EXPECT_EQ_MSG(test,
+				sps30_test_float(sps30_test_floats[i].val,
+						 sps30_test_res[j]),
+				sps30_test_floats[i].expected[j],
+				"float 0x%08x", sps30_test_floats[i].val);
+	}
+}
+
+/*
+ * Every float the sensor can report is checked against the reference, at
+ * every resolution. Below SPS30_TEST_EXP_MIN everything truncates to 0,
+ * there the smallest and largest mantissa of every exponent has to do.
+ */
+static void sps30_test_float_exhaustive(struct kunit *test)
+{
+	u32 val, first = 0, mismatches = 0;
+	int i, exp;
+
+	for (exp = -126; exp < SPS30_TEST_EXP_MIN; exp++) {
+		val = (u32)(exp + 127) << 23;
+		for (i = 0; i < ARRAY_SIZE(sps30_test_res); i++) {
+			KUNIT_EXPECT_EQ(test,
+					sps30_test_float(val,
+							 sps30_test_res[i]),
+					0);
+			KUNIT_EXPECT_EQ(test,
+					sps30_test_float(val | GENMASK(22, 0),
+							 sps30_test_res[i]),
+					0);
+		}
+	}
+
+	for (val = (u32)(SPS30_TEST_EXP_MIN + 127) << 23;
+	     val < SPS30_TEST_FLOAT_4096; val++) {
+		for (i = 0; i < ARRAY_SIZE(sps30_test_res); i++) {
+			if (sps30_test_float(val, sps30_test_res[i]) ==
+			    sps30_test_float_ref(val, sps30_test_res[i]))
+				continue;
+			if (!mismatches++)
+				first = val;
+		}
+
+		if (!(val & GENMASK(19, 0)))
+			cond_resched();
+	}
+
+	if (mismatches)
+		kunit_info(test, "first mismatch at 0x%08x\n", first);
+	KUNIT_EXPECT_EQ(test, mismatches, 0);
+}
+
+static s32 sps30_test_uint16(u16 val, int index, u32 res)
+{
+	u8 buf[2];
+
+	put_unaligned_be16(val, buf);
+
+	return sps30_uint16_to_int_clamped(buf, index, res);
+}
+
+static void sps30_test_uint16_edges(struct kunit *test)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sps30_test_res); i++) {
+		u32 res = sps30_test_res[i], max = SPS30_MAX_PM * res;
+
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(0, PM2P5, res), 0);
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(1, PM2P5, res), res);
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(SPS30_MAX_PM, PM2P5,
+							res), max);
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(SPS30_MAX_PM + 1,
+							NC10, res), max);
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(0xffff, PM10, res),
+				max);
+		/* particle size comes in nm and ignores the resolution */
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(450, TPS, res), 45);
+		KUNIT_EXPECT_EQ(test, sps30_test_uint16(0xffff, TPS, res),
+				6553);
+	}
+}
+
+static void sps30_test_uint16_exhaustive(struct kunit *test)
+{
+	u32 val, res, mismatches = 0;
+	int i;
+
+	for (val = 0; val <= U16_MAX; val++) {
+		for (i = 0; i < ARRAY_SIZE(sps30_test_res); i++) {
+			res = sps30_test_res[i];
+			if (sps30_test_uint16(val, PM1, res) !=
+			    min_t(u32, val, SPS30_MAX_PM) * res)
+				mismatches++;
+		}
+	}
+
+	KUNIT_EXPECT_EQ(test, mismatches, 0);
+}
+
+static int sps30_test_init(struct kunit *test)
+{
+	/* core fills in the same table once a sensor is probed */
+	crc8_populate_msb(sps30_crc8_table, SPS30_CRC8_POLYNOMIAL);
+
+	return 0;
+}
+
+/* whole frame as it comes off i2c, every word followed by its crc8 */
+static int sps30_test_raw_frame(bool uint16_format, u8 *payload, u8 *raw)
+{
+	int i, n = TPS + 1, words;
+
+	for (i = 0; i < n; i++) {
+		if (uint16_format)
+			put_unaligned_be16(100 * i + 7, &payload[2 * i]);
+		else
+			/* 1.5, 3, 6 up to 768 */
+			put_unaligned_be32(0x3fc00000 + (i << 23),
+					   &payload[4 * i]);
+	}
+
+	words = n * (uint16_format ? 1 : 2);
+	for (i = 0; i < words; i++) {
+		raw[3 * i] = payload[2 * i];
+		raw[3 * i + 1] = payload[2 * i + 1];
+		/* the long way, decoding goes through sps30_crc_word() */
+		raw[3 * i + 2] = crc8(sps30_crc8_table, &payload[2 * i], 2,
+				      CRC8_INIT_VALUE);
+	}
+
+	return n;
+}
+
+/* converts plain payload measurement by measurement */
+static void sps30_test_convert(bool uint16_format, const u8 *payload,
+			       s32 *meas, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (uint16_format)
+			meas[i] = sps30_uint16_to_int_clamped(&payload[2 * i],
+							      i, 100);
+		else
+			meas[i] = sps30_float_to_int_clamped(&payload[4 * i],
+					i == TPS ? SPS30_TPS_RES : 100);
+	}
+}
+
+/* decodes at 2 decimals, same as the driver does by default */
+static int sps30_test_decode_frame(bool uint16_format, bool crc,
+				   const u8 *raw, s32 *meas, int size)
+{
+	return sps30_decode(raw, meas, size, uint16_format, crc, 100);
+}
+
+static void sps30_test_decode(struct kunit *test, bool uint16_format)
+{
+	s32 meas[TPS + 1], ref[TPS + 1];
+	u8 raw[SPS30_MAX_RAW_SIZE], plain[SPS30_MAX_READ_SIZE];
+	int i, n;
+
+	n = sps30_test_raw_frame(uint16_format, plain, raw);
+	sps30_test_convert(uint16_format, plain, ref, n);
+	KUNIT_ASSERT_EQ(test, sps30_test_decode_frame(uint16_format, true, raw,
+						      meas, n), 0);
+	for (i = 0; i < n; i++)
+		KUNIT_EXPECT_EQ_MSG(test, meas[i], ref[i], "channel %d", i);
+
+	/* partial frames are decoded just the same */
+	KUNIT_ASSERT_EQ(test, sps30_test_decode_frame(uint16_format, true, raw,
+						      meas, PM10 + 1), 0);
+	for (i = 0; i <= PM10; i++)
+		KUNIT_EXPECT_EQ_MSG(test, meas[i], ref[i], "channel %d", i);
+
+	/* transports without word checksums hand over plain payload */
+	KUNIT_ASSERT_EQ(test, sps30_test_decode_frame(uint16_format, false,
+						      plain, meas, n), 0);
+	for (i = 0; i < n; i++)
+		KUNIT_EXPECT_EQ_MSG(test, meas[i], ref[i], "channel %d", i);
+
+	/* any single corrupted data or checksum byte is caught */
+	for (i = 0; i < n * (uint16_format ? 3 : 6); i++) {
+		raw[i] ^= BIT(i % 8);
+		KUNIT_EXPECT_EQ_MSG(test,
+				    sps30_test_decode_frame(uint16_format, true,
+							    raw, meas, n),
+				    -EBADMSG, "byte %d", i);
+		raw[i] ^= BIT(i % 8);
+	}
+}
+
+static void sps30_test_decode_float(struct kunit *test)
+{
+	sps30_test_decode(test, false);
+}
+
+static void sps30_test_decode_uint16(struct kunit *test)
+{
+	sps30_test_decode(test, true);
+}
+
+static struct kunit_case sps30_test_cases[] = {
+	KUNIT_CASE(sps30_test_float_edges),
+	KUNIT_CASE_SLOW(sps30_test_float_exhaustive),
+	KUNIT_CASE(sps30_test_uint16_edges),
+	KUNIT_CASE(sps30_test_uint16_exhaustive),
+	KUNIT_CASE(sps30_test_decode_float),
+	KUNIT_CASE(sps30_test_decode_uint16),
+	{ }
+};
+
+static struct kunit_suite sps30_test_suite = {
+	.name = "sps30",
+	.init = sps30_test_init,
+	.test_cases = sps30_test_cases,
+};
+kunit_test_suite(sps30_test_suite);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif /* LINUX_VERSION_CODE >= 6.13.0 */
+
+MODULE_DESCRIPTION("KUnit tests for the Sensirion SPS30 driver");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,433 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sensirion SPS30 particulate matter sensor serial driver
+ *
+ * Sensor talks SHDLC over uart at 115200 baud, 8N1.
+ */
+
+#include <linux/completion.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mod_devicetable.h>
+#include <linux/module.h>
+#include <linux/serdev.h>
+#include <linux/string.h>
+
+#include "sps30.h"
+
+/* Sensirion compatibility code for older Kernel versions */
+#include <linux/version.h>
+
+#define SPS30_SERIAL_BAUD 115200
+/* sensor replies within 20 ms, leave some room for the uart */
+#define SPS30_SERIAL_TIMEOUT_MS 200
+#define SPS30_SERIAL_SOF_EOF 0x7e
+#define SPS30_SERIAL_ESCAPE 0x7d
+/* address, command, state, length and checksum, data aside */
+#define SPS30_SERIAL_REPLY_MIN_SIZE 5
+#define SPS30_SERIAL_REPLY_MAX_SIZE (SPS30_SERIAL_REPLY_MIN_SIZE + 255)
+/* longest request carries 5 bytes of data, each one possibly escaped */
+#define SPS30_SERIAL_REQUEST_MAX_SIZE (2 + 2 * (4 + 5))
+/* lower bits of the state byte hold the error code */
+#define SPS30_SERIAL_STATE_ERROR GENMASK(6, 0)
+
+/* SHDLC commands */
+#define SPS30_SERIAL_START_MEAS 0x00
+#define SPS30_SERIAL_STOP_MEAS 0x01
+#define SPS30_SERIAL_READ_MEAS 0x03
+#define SPS30_SERIAL_SLEEP 0x10
+#define SPS30_SERIAL_WAKEUP 0x11
+#define SPS30_SERIAL_START_FAN_CLEANING 0x56
+#define SPS30_SERIAL_AUTO_CLEANING_PERIOD 0x80
+#define SPS30_SERIAL_DEVICE_INFO 0xd0
+#define SPS30_SERIAL_READ_VERSION 0xd1
+#define SPS30_SERIAL_READ_DEVICE_STATUS 0xd2
+#define SPS30_SERIAL_RESET 0xd3
+/* device info subcommand */
+#define SPS30_SERIAL_SERIAL_NUMBER 0x03
+
+struct sps30_serial_priv {
+	struct serdev_device *serdev;
+	/* port is closed before the core state is freed, see detach */
+	bool open;
+	struct completion rx_done;
+	/* reply frame being received, unescaped, start and end stripped */
+	u8 rx[SPS30_SERIAL_REPLY_MAX_SIZE];
+	int rx_len;
+	bool rx_active;
+	bool rx_escaped;
+	/*
+	 * There is no data-ready flag, reading measurements returns nothing
+	 * until there is a new frame. Frame found while polling for data-ready
+	 * is kept here until read.
+	 */
+	u8 meas[SPS30_MAX_READ_SIZE];
+	int meas_len;
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+static int sps30_serial_receive_buf(struct serdev_device *serdev,
+				    const unsigned char *buf, size_t size)
+#else
+static size_t sps30_serial_receive_buf(struct serdev_device *serdev,
+				       const u8 *buf, size_t size)
+#endif /* LINUX_VERSION_CODE < 6.8.0 */
+{
+	struct sps30_state *state = serdev_device_get_drvdata(serdev);
+	struct sps30_serial_priv *priv;
+	size_t i;
+	u8 c;
+
+	/* nothing was asked for yet */
+	if (!state)
+		return size;
+
+	priv = sps30_get_priv(state);
+	for (i = 0; i < size; i++) {
+		c = buf[i];
+		if (c == SPS30_SERIAL_SOF_EOF) {
+			/* either end of a reply or start of a new one */
+			if (priv->rx_active &&
+			    priv->rx_len >= SPS30_SERIAL_REPLY_MIN_SIZE) {
+				priv->rx_active = false;
+				complete(&priv->rx_done);
+			} else {
+				priv->rx_active = true;
+				priv->rx_escaped = false;
+				priv->rx_len = 0;
+			}
+			continue;
+		}
+
+		if (!priv->rx_active)
+			continue;
+
+		if (c == SPS30_SERIAL_ESCAPE) {
+			priv->rx_escaped = true;
+			continue;
+		}
+
+		if (priv->rx_escaped) {
+			c ^= 0x20;
+			priv->rx_escaped = false;
+		}
+
+		/* garbage, wait for the next start of frame */
+		if (priv->rx_len == sizeof(priv->rx)) {
+			priv->rx_active = false;
+			continue;
+		}
+
+		priv->rx[priv->rx_len++] = c;
+	}
+
+	return size;
+}
+
+static const struct serdev_device_ops sps30_serial_device_ops = {
+	.receive_buf = sps30_serial_receive_buf,
+	.write_wakeup = serdev_device_write_wakeup,
+};
+
+static int sps30_serial_put(u8 *buf, int len, u8 c)
+{
+	switch (c) {
+	case SPS30_SERIAL_SOF_EOF:
+	case SPS30_SERIAL_ESCAPE:
+	case 0x11:
+	case 0x13:
+		buf[len++] = SPS30_SERIAL_ESCAPE;
+		buf[len++] = c ^ 0x20;
+		break;
+	default:
+		buf[len++] = c;
+		break;
+	}
+
+	return len;
+}
+
+/*
+ * Sends a request and waits for the reply. Up to rsp_size bytes of reply
+ * data are copied to rsp. Returns length of reply data or an error.
+ */
+static int sps30_serial_command(struct sps30_state *state, u8 cmd,
+				const u8 *arg, int arg_size, u8 *rsp,
+				int rsp_size)
+{
+	struct sps30_serial_priv *priv = sps30_get_priv(state);
+	u8 buf[SPS30_SERIAL_REQUEST_MAX_SIZE];
+	ktime_t start = ktime_get();
+	int i, len = 0, ret;
+	u8 sum;
+
+	/* address is always 0 */
+	buf[len++] = SPS30_SERIAL_SOF_EOF;
+	len = sps30_serial_put(buf, len, 0);
+	len = sps30_serial_put(buf, len, cmd);
+	len = sps30_serial_put(buf, len, arg_size);
+	sum = cmd + arg_size;
+	for (i = 0; i < arg_size; i++) {
+		len = sps30_serial_put(buf, len, arg[i]);
+		sum += arg[i];
+	}
+	len = sps30_serial_put(buf, len, ~sum);
+	buf[len++] = SPS30_SERIAL_SOF_EOF;
+
+	reinit_completion(&priv->rx_done);
+	ret = serdev_device_write(priv->serdev, buf, len,
+				  msecs_to_jiffies(SPS30_SERIAL_TIMEOUT_MS));
+	if (ret != len) {
+		ret = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+
+	if (!wait_for_completion_timeout(&priv->rx_done,
+			msecs_to_jiffies(SPS30_SERIAL_TIMEOUT_MS))) {
+		ret = -ETIMEDOUT;
+		goto out;
+	}
+
+	/* address, command, state, length, data and checksum */
+	sum = 0;
+	for (i = 0; i < priv->rx_len - 1; i++)
+		sum += priv->rx[i];
+	if (priv->rx[0] || priv->rx[1] != cmd ||
+	    priv->rx[3] != priv->rx_len - SPS30_SERIAL_REPLY_MIN_SIZE ||
+	    (u8)~sum != priv->rx[priv->rx_len - 1]) {
+		ret = -EBADMSG;
+		goto out;
+	}
+
+	if (priv->rx[2] & SPS30_SERIAL_STATE_ERROR) {
+		dev_dbg(&priv->serdev->dev, "command 0x%02x failed: 0x%02x\n",
+			cmd, priv->rx[2] & SPS30_SERIAL_STATE_ERROR);
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = priv->rx[3];
+	if (rsp)
+		memcpy(rsp, &priv->rx[4], min(ret, rsp_size));
+out:
+	sps30_xfer_done(state, start, len, ret < 0 ? 0 : priv->rx_len + 2,
+			min(ret, 0));
+
+	return ret;
+}
+
+/* same as sps30_serial_command() but insists on rsp_size bytes of reply */
+static int sps30_serial_read(struct sps30_state *state, u8 cmd,
+			     const u8 *arg, int arg_size, u8 *rsp,
+			     int rsp_size)
+{
+	int ret;
+
+	ret = sps30_serial_command(state, cmd, arg, arg_size, rsp, rsp_size);
+	if (ret < 0)
+		return ret;
+
+	return ret < rsp_size ? -EIO : 0;
+}
+
+static int sps30_serial_read_meas(struct sps30_state *state)
+{
+	struct sps30_serial_priv *priv = sps30_get_priv(state);
+	int ret;
+
+	if (priv->meas_len)
+		return 0;
+
+	ret = sps30_serial_command(state, SPS30_SERIAL_READ_MEAS, NULL, 0,
+				   priv->meas, sizeof(priv->meas));
+	if (ret < 0)
+		return ret;
+
+	priv->meas_len = min_t(int, ret, sizeof(priv->meas));
+
+	return 0;
+}
+
+static int sps30_serial_do_cmd(struct sps30_state *state, u16 cmd, u8 *data,
+			       int size)
+{
+	struct sps30_serial_priv *priv = sps30_get_priv(state);
+	u8 wakeup = 0xff, arg[5] = { };
+	int ret;
+
+	switch (cmd) {
+	case SPS30_START_MEAS:
+		/* measurement mode and output format */
+		arg[0] = 0x01;
+		arg[1] = data[0];
+		priv->meas_len = 0;
+		ret = sps30_serial_command(state, SPS30_SERIAL_START_MEAS, arg,
+					   2, NULL, 0);
+		break;
+	case SPS30_STOP_MEAS:
+		priv->meas_len = 0;
+		ret = sps30_serial_command(state, SPS30_SERIAL_STOP_MEAS, NULL,
+					   0, NULL, 0);
+		break;
+	case SPS30_RESET:
+		priv->meas_len = 0;
+		ret = sps30_serial_command(state, SPS30_SERIAL_RESET, NULL, 0,
+					   NULL, 0);
+		break;
+	case SPS30_START_FAN_CLEANING:
+		ret = sps30_serial_command(state,
+					   SPS30_SERIAL_START_FAN_CLEANING,
+					   NULL, 0, NULL, 0);
+		break;
+	case SPS30_SLEEP:
+		ret = sps30_serial_command(state, SPS30_SERIAL_SLEEP, NULL, 0,
+					   NULL, 0);
+		break;
+	case SPS30_WAKEUP:
+		/* a low pulse on rx wakes up the interface */
+		ret = serdev_device_write(priv->serdev, &wakeup, 1,
+				msecs_to_jiffies(SPS30_SERIAL_TIMEOUT_MS));
+		if (ret < 0)
+			return ret;
+
+		ret = sps30_serial_command(state, SPS30_SERIAL_WAKEUP, NULL, 0,
+					   NULL, 0);
+		break;
+	case SPS30_READ_DATA_READY_FLAG:
+		ret = sps30_serial_read_meas(state);
+		if (ret)
+			return ret;
+
+		data[0] = 0;
+		data[1] = !!priv->meas_len;
+
+		return 0;
+	case SPS30_READ_DATA:
+		ret = sps30_serial_read_meas(state);
+		if (ret)
+			return ret;
+
+		if (priv->meas_len < size) {
+			priv->meas_len = 0;
+			return -ENODATA;
+		}
+
+		memcpy(data, priv->meas, size);
+		priv->meas_len = 0;
+
+		return 0;
+	case SPS30_READ_SERIAL:
+		arg[0] = SPS30_SERIAL_SERIAL_NUMBER;
+		ret = sps30_serial_command(state, SPS30_SERIAL_DEVICE_INFO, arg,
+					   1, data, size);
+		if (ret < 0)
+			return ret;
+
+		/* string comes NUL terminated but possibly shorter */
+		if (ret < size)
+			memset(data + ret, 0, size - ret);
+
+		return 0;
+	case SPS30_READ_VERSION:
+		return sps30_serial_read(state, SPS30_SERIAL_READ_VERSION, NULL,
+					 0, data, size);
+	case SPS30_AUTO_CLEANING_PERIOD:
+		memcpy(&arg[1], data, 4);
+		ret = sps30_serial_command(state,
+					   SPS30_SERIAL_AUTO_CLEANING_PERIOD,
+					   arg, 5, NULL, 0);
+		break;
+	case SPS30_READ_AUTO_CLEANING_PERIOD:
+		return sps30_serial_read(state,
+					 SPS30_SERIAL_AUTO_CLEANING_PERIOD,
+					 arg, 1, data, size);
+	case SPS30_READ_DEVICE_STATUS:
+		/* leave the flags alone, they are cleared only on request */
+		return sps30_serial_read(state,
+					 SPS30_SERIAL_READ_DEVICE_STATUS,
+					 arg, 1, data, size);
+	default:
+		return -EINVAL;
+	}
+
+	return min(ret, 0);
+}
+
+static void sps30_serial_close(void *data)
+{
+	struct sps30_serial_priv *priv = data;
+
+	if (!priv->open)
+		return;
+
+	/* no more receive_buf calls once this returns */
+	serdev_device_close(priv->serdev);
+	priv->open = false;
+}
+
+/* late replies must not reach the core state while it gets freed */
+static void sps30_serial_detach(struct sps30_state *state)
+{
+	sps30_serial_close(sps30_get_priv(state));
+}
+
+static const struct sps30_ops sps30_serial_ops = {
+	.do_cmd = sps30_serial_do_cmd,
+	.detach = sps30_serial_detach,
+};
+
+static int sps30_serial_probe(struct serdev_device *serdev)
+{
+	struct device *dev = &serdev->dev;
+	struct sps30_serial_priv *priv;
+	int ret;
+
+	priv = devm_kzalloc(dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	priv->serdev = serdev;
+	init_completion(&priv->rx_done);
+	serdev_device_set_client_ops(serdev, &sps30_serial_device_ops);
+
+	ret = serdev_device_open(serdev);
+	if (ret)
+		return ret;
+	priv->open = true;
+
+	/* for errors before the core takes over closing in detach */
+	ret = devm_add_action_or_reset(dev, sps30_serial_close, priv);
+	if (ret)
+		return ret;
+
+	serdev_device_set_baudrate(serdev, SPS30_SERIAL_BAUD);
+	serdev_device_set_flow_control(serdev, false);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	ret = serdev_device_set_parity(serdev, SERDEV_PARITY_NONE);
+	if (ret)
+		return ret;
+#endif /* LINUX_VERSION_CODE >= 4.19.0 */
+
+	return sps30_probe(dev, "sps30", priv, &sps30_serial_ops);
+}
+
+static const struct of_device_id sps30_serial_of_match[] = {
+	{ .compatible = "sensirion,sps30" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, sps30_serial_of_match);
+
+static struct serdev_device_driver sps30_serial_driver = {
+	.driver = {
+		.name = "sps30",
+		.of_match_table = sps30_serial_of_match,
+		.pm = &sps30_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = sps30_serial_probe,
+};
+module_serdev_device_driver(sps30_serial_driver);
+
+MODULE_DESCRIPTION("Sensirion SPS30 particulate matter sensor serial driver");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the Sensirion SPS30 particulate matter sensor driver
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sps30
+
+#if !defined(_SPS30_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SPS30_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#ifndef sps30_assign_dev
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+#define sps30_assign_dev(dev) __assign_str(dev, dev_name(dev))
+#else
+#define sps30_assign_dev(dev) __assign_str(dev)
+#endif /* LINUX_VERSION_CODE < 6.10.0 */
+#endif /* sps30_assign_dev */
+
+DECLARE_EVENT_CLASS(sps30_cmd,
+	TP_PROTO(const struct device *dev, u16 cmd, int size, int ret),
+	TP_ARGS(dev, cmd, size, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u16, cmd)
+		__field(int, size)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		sps30_assign_dev(dev);
+		__entry->cmd = cmd;
+		__entry->size = size;
+		__entry->ret = ret;
+	),
+	TP_printk("%s cmd=0x%04x size=%d ret=%d", __get_str(dev),
+		  __entry->cmd, __entry->size, __entry->ret)
+);
+
+DEFINE_EVENT(sps30_cmd, sps30_cmd_start,
+	TP_PROTO(const struct device *dev, u16 cmd, int size, int ret),
+	TP_ARGS(dev, cmd, size, ret)
+);
+
+DEFINE_EVENT(sps30_cmd, sps30_cmd_end,
+	TP_PROTO(const struct device *dev, u16 cmd, int size, int ret),
+	TP_ARGS(dev, cmd, size, ret)
+);
+
+TRACE_EVENT(sps30_xfer,
+	TP_PROTO(const struct device *dev, int txsize, int rxsize, int ret),
+	TP_ARGS(dev, txsize, rxsize, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, txsize)
+		__field(int, rxsize)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		sps30_assign_dev(dev);
+		__entry->txsize = txsize;
+		__entry->rxsize = rxsize;
+		__entry->ret = ret;
+	),
+	TP_printk("%s tx=%d rx=%d ret=%d", __get_str(dev), __entry->txsize,
+		  __entry->rxsize, __entry->ret)
+);
+
+TRACE_EVENT(sps30_poll,
+	TP_PROTO(const struct device *dev, bool predicted, int ret),
+	TP_ARGS(dev, predicted, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(bool, predicted)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		sps30_assign_dev(dev);
+		__entry->predicted = predicted;
+		__entry->ret = ret;
+	),
+	TP_printk("%s predicted=%d ready=%d", __get_str(dev),
+		  __entry->predicted, __entry->ret)
+);
+
+TRACE_EVENT(sps30_push,
+	TP_PROTO(const struct device *dev, s64 ts, s32 pm2p5),
+	TP_ARGS(dev, ts, pm2p5),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(s64, ts)
+		__field(s32, pm2p5)
+	),
+	TP_fast_assign(
+		sps30_assign_dev(dev);
+		__entry->ts = ts;
+		__entry->pm2p5 = pm2p5;
+	),
+	TP_printk("%s ts=%lld pm2p5=%d.%02d", __get_str(dev), __entry->ts,
+		  __entry->pm2p5 / 100, __entry->pm2p5 % 100)
+);
+
+#endif /* _SPS30_TRACE_H */
+
+/* this part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sps30_trace
+#include <trace/define_trace.h>
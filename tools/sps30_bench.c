@@ -0,0 +1,612 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Benchmark for the Sensirion SPS30 particulate matter sensor driver
+ *
+ * Takes a number of samples through sysfs, the snapshot attribute and the
+ * buffer, and reports read latency percentiles, bus traffic per sample as
+ * counted by the driver in debugfs and CPU time per sample. Meant to be run
+ * against sps30_emu, so that results do not depend on a real sensor, and
+ * against two builds of the driver to compare them.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IIO_DEVICES
+#define IIO_DEVICES "/sys/bus/iio/devices"
+#endif
+#ifndef DEBUGFS
+#define DEBUGFS "/sys/kernel/debug"
+#endif
+#define MAX_NAME 64
+#define MAX_DIR 256
+#define MAX_CHANNELS 16
+#define MAX_SAMPLE_SIZE 128
+#define BUFFER_LENGTH 64
+
+enum mode {
+	MODE_SYSFS,
+	MODE_SNAPSHOT,
+	MODE_BUFFER,
+	MODE_MAX,
+};
+
+static const char * const mode_names[] = {
+	[MODE_SYSFS] = "sysfs",
+	[MODE_SNAPSHOT] = "snapshot",
+	[MODE_BUFFER] = "buffer",
+};
+
+/* driver counters a run is accounted with, see debugfs stats */
+struct counters {
+	bool valid;
+	unsigned long long cmds;
+	unsigned long long bytes;
+	unsigned long long polls;
+	unsigned long long frames;
+	unsigned long long crc_errors;
+	unsigned long long xfers;
+};
+
+struct usage {
+	struct timespec wall;
+	long long cpu_us;
+	long long sys_busy_us;
+};
+
+struct channel {
+	char name[MAX_NAME];
+	int index;
+	int bytes;
+	int offset;
+	bool prev_en;
+};
+
+static char iio_dir[MAX_DIR];
+static char dev_node[MAX_DIR];
+static char debugfs_dir[MAX_DIR];
+
+static long long ts_us(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000LL + ts->tv_nsec / 1000;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+
+	buf[len] = '\0';
+
+	return len;
+}
+
+static int write_attr(const char *attr, const char *val)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", iio_dir, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	len = write(fd, val, strlen(val));
+	close(fd);
+
+	return len < 0 ? -errno : 0;
+}
+
+static int read_attr_int(const char *attr, int *val)
+{
+	char path[PATH_MAX], buf[64];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", iio_dir, attr);
+	ret = read_file(path, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	*val = atoi(buf);
+
+	return 0;
+}
+
+/* picks the first iio device named sps30 unless told otherwise */
+static int find_device(const char *name)
+{
+	char path[PATH_MAX], buf[64], *parent;
+	struct dirent *de;
+	DIR *dir;
+
+	if (name) {
+		snprintf(iio_dir, sizeof(iio_dir), IIO_DEVICES "/%s", name);
+	} else {
+		dir = opendir(IIO_DEVICES);
+		if (!dir)
+			return -errno;
+
+		while ((de = readdir(dir))) {
+			if (strncmp(de->d_name, "iio:device", 10))
+				continue;
+
+			snprintf(path, sizeof(path), IIO_DEVICES "/%s/name",
+				 de->d_name);
+			if (read_file(path, buf, sizeof(buf)) < 0 ||
+			    strcmp(buf, "sps30\n"))
+				continue;
+
+			snprintf(iio_dir, sizeof(iio_dir), IIO_DEVICES "/%.*s",
+				 MAX_NAME, de->d_name);
+			break;
+		}
+		closedir(dir);
+		if (!iio_dir[0])
+			return -ENODEV;
+	}
+
+	if (!realpath(iio_dir, path))
+		return -errno;
+
+	snprintf(dev_node, sizeof(dev_node), "/dev/%s", basename(path));
+	/* debugfs directory is named after the parent, i2c or serdev device */
+	parent = basename(dirname(path));
+	if (!debugfs_dir[0])
+		snprintf(debugfs_dir, sizeof(debugfs_dir), DEBUGFS "/sps30-%s",
+			 parent);
+
+	return 0;
+}
+
+static void read_counters(struct counters *c)
+{
+	char path[PATH_MAX], buf[4096], *line, *save;
+	unsigned long long val, lower;
+
+	memset(c, 0, sizeof(*c));
+
+	snprintf(path, sizeof(path), "%s/stats", debugfs_dir);
+	if (read_file(path, buf, sizeof(buf)) < 0)
+		return;
+
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		char *sep = strchr(line, ':');
+
+		if (!sep)
+			continue;
+
+		*sep = '\0';
+		val = strtoull(sep + 1, NULL, 10);
+		if (!strncmp(line, "cmd_", 4))
+			c->cmds += val;
+		else if (!strcmp(line, "tx_bytes") || !strcmp(line, "rx_bytes"))
+			c->bytes += val;
+		else if (!strcmp(line, "polls"))
+			c->polls = val;
+		else if (!strcmp(line, "frames"))
+			c->frames = val;
+		else if (!strcmp(line, "crc_errors"))
+			c->crc_errors = val;
+	}
+
+	/* every exchange on the bus lands in one bucket of the histogram */
+	snprintf(path, sizeof(path), "%s/xfer_latency_us", debugfs_dir);
+	if (read_file(path, buf, sizeof(buf)) < 0)
+		return;
+
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "%llu %llu", &lower, &val) == 2)
+			c->xfers += val;
+	}
+
+	c->valid = true;
+}
+
+/* time spent by all cpus outside idle, kernel workers included */
+static long long sys_busy_us(void)
+{
+	unsigned long long user, nice, system, irq, softirq;
+	long hz = sysconf(_SC_CLK_TCK);
+	char buf[256];
+
+	if (read_file("/proc/stat", buf, sizeof(buf)) < 0)
+		return 0;
+
+	if (sscanf(buf, "cpu %llu %llu %llu %*u %*u %llu %llu", &user, &nice,
+		   &system, &irq, &softirq) != 5)
+		return 0;
+
+	return (user + nice + system + irq + softirq) * 1000000LL / hz;
+}
+
+static void read_usage(struct usage *u)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	clock_gettime(CLOCK_MONOTONIC, &u->wall);
+	u->cpu_us = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec +
+		    ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+	u->sys_busy_us = sys_busy_us();
+}
+
+/* reads an attribute over and over, latency being the time read takes */
+static int bench_attr(const char *attr, long long *lat, int n)
+{
+	char path[PATH_MAX], buf[4096];
+	long long start;
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", iio_dir, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		start = now_ns();
+		/* sysfs produces fresh contents on every read from offset 0 */
+		if (pread(fd, buf, sizeof(buf), 0) < 0) {
+			close(fd);
+			return -errno;
+		}
+		lat[i] = now_ns() - start;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int bench_sysfs(long long *lat, int n)
+{
+	char path[PATH_MAX];
+	const char *attr = "in_massconcentration_pm2p5_input";
+
+	/* kernels before 4.21 have no mass concentration channel type */
+	snprintf(path, sizeof(path), "%s/%s", iio_dir, attr);
+	if (access(path, R_OK))
+		attr = "in_concentration_pm2p5_input";
+
+	return bench_attr(attr, lat, n);
+}
+
+static int bench_snapshot(long long *lat, int n)
+{
+	return bench_attr("snapshot", lat, n);
+}
+
+static int cmp_channel(const void *a, const void *b)
+{
+	return ((const struct channel *)a)->index -
+	       ((const struct channel *)b)->index;
+}
+
+/* enables every channel, returns the sample size of the resulting layout */
+static int setup_channels(struct channel *chans, int *num)
+{
+	char attr[PATH_MAX], path[PATH_MAX], buf[64];
+	int i, n = 0, offset = 0, bits, val;
+	struct dirent *de;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/scan_elements", iio_dir);
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir)) && n < MAX_CHANNELS) {
+		size_t len = strlen(de->d_name);
+
+		if (len < 4 || strcmp(de->d_name + len - 3, "_en"))
+			continue;
+
+		if (len - 3 >= MAX_NAME)
+			continue;
+
+		snprintf(chans[n].name, sizeof(chans[n].name), "%.*s",
+			 (int)(len - 3), de->d_name);
+		n++;
+	}
+	closedir(dir);
+
+	for (i = 0; i < n; i++) {
+		snprintf(attr, sizeof(attr), "scan_elements/%s_index",
+			 chans[i].name);
+		if (read_attr_int(attr, &chans[i].index))
+			return -EINVAL;
+
+		/* e.g. le:u25/32>>0, storage bits follow the slash */
+		snprintf(path, sizeof(path), "%s/scan_elements/%s_type",
+			 iio_dir, chans[i].name);
+		if (read_file(path, buf, sizeof(buf)) < 0 ||
+		    sscanf(buf, "%*[^/]/%d", &bits) != 1)
+			return -EINVAL;
+		chans[i].bytes = bits / 8;
+
+		snprintf(attr, sizeof(attr), "scan_elements/%s_en",
+			 chans[i].name);
+		if (read_attr_int(attr, &val))
+			return -EINVAL;
+		chans[i].prev_en = val;
+		if (write_attr(attr, "1"))
+			return -EIO;
+	}
+
+	/* samples are laid out by index, each channel naturally aligned */
+	qsort(chans, n, sizeof(*chans), cmp_channel);
+	for (i = 0; i < n; i++) {
+		offset = (offset + chans[i].bytes - 1) / chans[i].bytes *
+			 chans[i].bytes;
+		chans[i].offset = offset;
+		offset += chans[i].bytes;
+	}
+	/* and the sample as a whole is aligned to its largest channel */
+	for (i = 0, bits = 1; i < n; i++)
+		if (chans[i].bytes > bits)
+			bits = chans[i].bytes;
+	offset = (offset + bits - 1) / bits * bits;
+
+	*num = n;
+
+	return offset;
+}
+
+static void restore_channels(const struct channel *chans, int n)
+{
+	char attr[PATH_MAX];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(attr, sizeof(attr), "scan_elements/%s_en",
+			 chans[i].name);
+		write_attr(attr, chans[i].prev_en ? "1" : "0");
+	}
+}
+
+/*
+ * Captures samples through the driver's trigger. Latency is the time from
+ * the sample timestamp, taken when the measurement was read off the sensor,
+ * to the sample reaching userspace.
+ */
+static int bench_buffer(long long *lat, int n)
+{
+	struct channel chans[MAX_CHANNELS];
+	uint8_t sample[MAX_SAMPLE_SIZE];
+	int i, fd, size, num = 0, ret;
+	const struct channel *ts;
+	char len[16];
+	int64_t stamp;
+	ssize_t got;
+
+	write_attr("buffer/enable", "0");
+	size = setup_channels(chans, &num);
+	if (size <= 0 || size > MAX_SAMPLE_SIZE || !num) {
+		ret = size < 0 ? size : -EINVAL;
+		goto out;
+	}
+
+	/* timestamp is the channel with the highest index */
+	ts = &chans[num - 1];
+	if (strcmp(ts->name, "timestamp") || ts->bytes != sizeof(stamp)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	snprintf(len, sizeof(len), "%d", BUFFER_LENGTH);
+	write_attr("current_timestamp_clock", "monotonic");
+	write_attr("buffer/length", len);
+	write_attr("buffer/watermark", "1");
+
+	fd = open(dev_node, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = write_attr("buffer/enable", "1");
+	if (ret)
+		goto out_close;
+
+	for (i = 0; i < n; i++) {
+		got = read(fd, sample, size);
+		if (got != size) {
+			ret = got < 0 ? -errno : -EIO;
+			break;
+		}
+
+		memcpy(&stamp, sample + ts->offset, sizeof(stamp));
+		lat[i] = now_ns() - stamp;
+	}
+
+	write_attr("buffer/enable", "0");
+out_close:
+	close(fd);
+out:
+	restore_channels(chans, num);
+
+	return ret;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const long long *sorted, int n, int pct)
+{
+	int i = (n * pct + 99) / 100 - 1;
+
+	return sorted[i < 0 ? 0 : i] / 1000.0;
+}
+
+static void report(enum mode mode, long long *lat, int n,
+		   const struct counters *c0, const struct counters *c1,
+		   const struct usage *u0, const struct usage *u1)
+{
+	double wall = (ts_us(&u1->wall) - ts_us(&u0->wall)) / 1e6;
+
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf("%-8s %7d %9.1f %9.1f %9.1f %9.1f", mode_names[mode], n,
+	       percentile_us(lat, n, 50), percentile_us(lat, n, 90),
+	       percentile_us(lat, n, 99), lat[n - 1] / 1000.0);
+
+	if (c0->valid && c1->valid)
+		printf(" %7.2f %7.2f %7.2f %8.1f %5llu",
+		       (double)(c1->xfers - c0->xfers) / n,
+		       (double)(c1->cmds - c0->cmds) / n,
+		       (double)(c1->polls - c0->polls) / n,
+		       (double)(c1->bytes - c0->bytes) / n,
+		       c1->crc_errors - c0->crc_errors);
+	else
+		printf(" %7s %7s %7s %8s %5s", "-", "-", "-", "-", "-");
+
+	printf(" %8.1f %8.1f %7.1f\n",
+	       (double)(u1->cpu_us - u0->cpu_us) / n,
+	       (double)(u1->sys_busy_us - u0->sys_busy_us) / n, wall);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d iio:deviceN] [-D dir] [-n samples] [-m mode]\n"
+		"  -d  iio device, first one named sps30 by default\n"
+		"  -D  driver debugfs directory, derived from the device\n"
+		"  -n  samples taken per mode (default: 100)\n"
+		"  -m  sysfs, snapshot, buffer or all (default: all)\n"
+		"  -C  bypass the cache, read every sample off the sensor\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	int (*const bench[])(long long *lat, int n) = {
+		[MODE_SYSFS] = bench_sysfs,
+		[MODE_SNAPSHOT] = bench_snapshot,
+		[MODE_BUFFER] = bench_buffer,
+	};
+	const char *dev = NULL, *mode_arg = "all";
+	int c, n = 100, ret, failed = 0, cache_age = -1;
+	bool uncached = false;
+	char age[16];
+	struct counters c0, c1;
+	struct usage u0, u1;
+	long long *lat;
+	enum mode mode;
+
+	while ((c = getopt(argc, argv, "d:D:n:m:Ch")) != -1) {
+		switch (c) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'D':
+			snprintf(debugfs_dir, sizeof(debugfs_dir), "%s",
+				 optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'm':
+			mode_arg = optarg;
+			break;
+		case 'C':
+			uncached = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (n < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = find_device(dev);
+	if (ret) {
+		fprintf(stderr, "no sps30 device found: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	lat = calloc(n, sizeof(*lat));
+	if (!lat)
+		return 1;
+
+	/* decoding only shows in the figures if every read does it */
+	if (uncached && (read_attr_int("cache_max_age_ms", &cache_age) ||
+			 write_attr("cache_max_age_ms", "0"))) {
+		fprintf(stderr, "cannot disable the cache\n");
+		free(lat);
+		return 1;
+	}
+
+	printf("# %s, bus counters from %s%s%s\n", iio_dir, debugfs_dir,
+	       access(debugfs_dir, R_OK) ? " (unavailable)" : "",
+	       uncached ? ", uncached" : "");
+	printf("# latency in us, traffic and cpu time in us per sample\n");
+	printf("%-8s %7s %9s %9s %9s %9s %7s %7s %7s %8s %5s %8s %8s %7s\n",
+	       "mode", "samples", "p50", "p90", "p99", "max", "xfers", "cmds",
+	       "polls", "bytes", "crc", "cpu", "sys_cpu", "wall_s");
+
+	for (mode = 0; mode < MODE_MAX; mode++) {
+		if (strcmp(mode_arg, "all") && strcmp(mode_arg,
+						      mode_names[mode]))
+			continue;
+
+		read_counters(&c0);
+		read_usage(&u0);
+		ret = bench[mode](lat, n);
+		read_usage(&u1);
+		read_counters(&c1);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", mode_names[mode],
+				strerror(-ret));
+			failed = 1;
+			continue;
+		}
+
+		report(mode, lat, n, &c0, &c1, &u0, &u1);
+	}
+
+	if (cache_age >= 0) {
+		snprintf(age, sizeof(age), "%d", cache_age);
+		write_attr("cache_max_age_ms", age);
+	}
+	free(lat);
+
+	return failed;
+}